@@ -0,0 +1,120 @@
+//
+//  bench.cpp
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#include "bench.h"
+#include "clcompat.h"
+#include "integrator.h"
+#include "interleave.h"
+#include "bvh4.h"
+#include <stdio.h>
+
+// passes over the ray set for each timing
+#define BENCH_PASSES 4
+
+// scalar port of the kernel traversal, the reference
+static double traceScalar(Scene *scene, const std::vector<Ray> &rays, std::vector<Hit> &hits) {
+    counter_t counter = {{0}};
+    Primitive *primitives = &scene->primitive_vector[0];
+    const int numprimitives = (int)scene->primitive_vector.size();
+    BVHNode *bvh = &scene->bvhTree->bvh_vec[0];
+    
+    double start = wallclock();
+    for (int pass = 0; pass < BENCH_PASSES; pass ++) {
+        for (size_t i = 0; i < rays.size(); i ++) {
+            Primitive *s = NULL;
+            float distance = FLT_MAX;
+            scene_intersect(&counter, primitives, numprimitives, &rays[i], &s, bvh, NULL, &distance, false);
+            hits[i].pid = s ? (unsigned int)(s - primitives) : P_NONE;
+            hits[i].distance = distance;
+        }
+    }
+    return wallclock() - start;
+}
+
+static double traceInterleaved(Scene *scene, const std::vector<Ray> &rays, std::vector<Hit> &hits) {
+    counter_t counter = {{0}};
+    Primitive *primitives = &scene->primitive_vector[0];
+    BVHNode *bvh = &scene->bvhTree->bvh_vec[0];
+    
+    double start = wallclock();
+    for (int pass = 0; pass < BENCH_PASSES; pass ++)
+        interleaved_intersect(&counter, primitives, bvh, &rays[0], &hits[0], (unsigned int)rays.size());
+    return wallclock() - start;
+}
+
+static double traceBVH4(const BVH4 *bvh4, const std::vector<Ray> &rays, std::vector<Hit> &hits) {
+    double start = wallclock();
+    for (int pass = 0; pass < BENCH_PASSES; pass ++) {
+        for (size_t i = 0; i < rays.size(); i ++) {
+            unsigned int pid = P_NONE;
+            float distance = FLT_MAX;
+            bvh4_intersect(bvh4, &rays[i], &pid, &distance, false);
+            hits[i].pid = pid;
+            hits[i].distance = distance;
+        }
+    }
+    return wallclock() - start;
+}
+
+static size_t mismatches(const std::vector<Hit> &a, const std::vector<Hit> &b) {
+    // equal distances on different primitives are ties, not errors
+    size_t count = 0;
+    for (size_t i = 0; i < a.size(); i ++)
+        if (a[i].pid != b[i].pid && a[i].distance != b[i].distance)
+            count ++;
+    return count;
+}
+
+// every traversal against the scalar one
+static void run(Scene *scene, const BVH4 *bvh4, const char *name, const std::vector<Ray> &rays, std::vector<Hit> &ref) {
+    std::vector<Hit> interleaved(rays.size()), simd(rays.size());
+    ref.resize(rays.size());
+    
+    const double t0 = traceScalar(scene, rays, ref);
+    const double t1 = traceInterleaved(scene, rays, interleaved);
+    const double t2 = traceBVH4(bvh4, rays, simd);
+    
+    const double mrays = 1e-6 * rays.size() * BENCH_PASSES;
+    printf("[Bench] %-9s %8zu rays  scalar: %7.2f  interleaved: %7.2f (%.2fx)  bvh4: %7.2f (%.2fx) Mrays/s  mismatches: %zu %zu\n",
+           name, rays.size(), mrays / t0, mrays / t1, t0 / t1, mrays / t2, t0 / t2,
+           mismatches(ref, interleaved), mismatches(ref, simd));
+}
+
+void bench(Scene *scene, int width, int height) {
+    BVH4 bvh4(scene->bvhTree, scene->primitive_vector);
+    Primitive *primitives = &scene->primitive_vector[0];
+    
+    std::vector<Ray> primary(width * height);
+    for (int i = 0; i < width * height; i ++) {
+        Sampler smp = sampler_init(i, 0, scene->seed);
+        float dx = i % width + sampler_next(&smp) - 0.5f;
+        float dy = i / width + sampler_next(&smp) - 0.5f;
+        primary[i] = camera_genray(&scene->camera, dx, dy, width, height);
+    }
+    
+    std::vector<Hit> ref;
+    run(scene, &bvh4, "primary", primary, ref);
+    
+    // incoherent rays: a diffuse bounce off every primary hit
+    std::vector<Ray> diffuse;
+    for (size_t i = 0; i < primary.size(); i ++) {
+        if (ref[i].pid == P_NONE)
+            continue;
+        Vector hit_point, normal;
+        float cos_i;
+        bool leaving;
+        hit_setup(primitives + ref[i].pid, &primary[i], ref[i].distance, &hit_point, &normal, &cos_i, &leaving);
+        
+        Ray r;
+        Sampler smp = sampler_init((unsigned int)i, 1, scene->seed);
+        ray_bounce(&r, hit_point, normal, &smp);
+        diffuse.push_back(r);
+    }
+    if (!diffuse.empty())
+        run(scene, &bvh4, "diffuse", diffuse, ref);
+}
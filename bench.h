@@ -0,0 +1,17 @@
+//
+//  bench.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef __Oculus__bench__
+#define __Oculus__bench__
+
+#include "scene.h"
+
+// single thread Mrays/s of the CPU traversals on primary and diffuse rays
+void bench(Scene *scene, int width, int height);
+
+#endif /* defined(__Oculus__bench__) */
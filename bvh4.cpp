@@ -0,0 +1,157 @@
+//
+//  bvh4.cpp
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#include "bvh4.h"
+#include <string.h>
+#include <algorithm>
+
+// subtrees with this many primitives or fewer become leaves
+#define BVH4_LEAF 4
+
+using std::cout;
+using std::endl;
+
+// primitives below a node of the binary tree
+static void subtree(const BVHTreeNode *node, std::vector<size_t> &pids)
+{
+    if (node->isLeaf()) {
+        pids.push_back(node->primitiveIndex);
+        return;
+    }
+    subtree(node->left, pids);
+    subtree(node->right, pids);
+}
+
+// union of the primitive boxes
+static BBox bounds(const std::vector<size_t> &pids, const std::vector<Primitive> &primitives)
+{
+    BBox box = BVHTreeNode(primitives[pids[0]], 0).bbox;
+    for (size_t i = 1; i < pids.size(); i ++)
+        box += BVHTreeNode(primitives[pids[i]], 0).bbox;
+    return box;
+}
+
+static float area(const BBox &box)
+{
+    const Vector e = box.max - box.min;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+BVH4::BVH4(const BVHTree *tree, const std::vector<Primitive> &primitives) {
+    depth = 0;
+    Build(tree->rootNode, primitives);
+    stackSize = 3 * depth + 1;
+    cout << "bvh4: " << nodes.size() << " nodes, " << leaves.size() << " leaves, depth " << depth << endl;
+}
+
+int BVH4::Build(const BVHTreeNode *node, const std::vector<Primitive> &primitives, int level) {
+    depth = std::max(depth, level);
+    std::vector<const BVHTreeNode *> open;
+    std::vector<std::vector<size_t> > pids;
+    std::vector<BBox> boxes;
+    
+    // open the largest child until there are four of them
+    open.push_back(node);
+    while (open.size() < 4) {
+        pids.assign(open.size(), std::vector<size_t>());
+        int best = -1;
+        float best_area = -1.f;
+        for (size_t i = 0; i < open.size(); i ++) {
+            subtree(open[i], pids[i]);
+            if (pids[i].size() <= BVH4_LEAF)
+                continue;
+            const float a = area(bounds(pids[i], primitives));
+            if (a > best_area) {
+                best_area = a;
+                best = (int)i;
+            }
+        }
+        if (best < 0)
+            break;
+        
+        const BVHTreeNode *n = open[best];
+        open[best] = n->left;
+        open.push_back(n->right);
+    }
+    
+    pids.assign(open.size(), std::vector<size_t>());
+    for (size_t i = 0; i < open.size(); i ++)
+        subtree(open[i], pids[i]);
+    
+    const int index = (int)nodes.size();
+    nodes.push_back(BVH4Node());
+    
+    BVH4Node n;
+    memset(&n, 0, sizeof(BVH4Node));
+    for (int i = 0; i < 4; i ++) {
+        n.child[i] = -1;
+        if (i >= (int)open.size())
+            continue;
+        
+        // pad the boxes so the reciprocal slab test keeps flat and grazing hits
+        const BBox box = bounds(pids[i], primitives);
+        for (int k = 0; k < 3; k ++) {
+            n.bmin[k][i] = box.min.s[k] - 1e-5f * (1.f + fabsf(box.min.s[k]));
+            n.bmax[k][i] = box.max.s[k] + 1e-5f * (1.f + fabsf(box.max.s[k]));
+        }
+        
+        if (pids[i].size() <= BVH4_LEAF)
+            BuildLeaf(pids[i], primitives, n.child[i], n.count[i]);
+        else
+            n.child[i] = Build(open[i], primitives, level + 1);
+    }
+    nodes[index] = n;
+    
+    return index;
+}
+
+// packs the primitives four by four, one type per packet
+void BVH4::BuildLeaf(const std::vector<size_t> &pids, const std::vector<Primitive> &primitives, int &first, int &count) {
+    first = (int)leaves.size();
+    
+    for (int type = sphere; type <= triangle; type ++) {
+        BVH4Leaf l;
+        int lane = 4;
+        
+        for (size_t i = 0; i < pids.size(); i ++) {
+            const Primitive &p = primitives[pids[i]];
+            if (p.t != type)
+                continue;
+            
+            if (lane == 4) {
+                memset(&l, 0, sizeof(BVH4Leaf));
+                l.type = type;
+                for (int j = 0; j < 4; j ++) {
+                    l.pid[j] = P_NONE;
+                    l.r2[j] = -FLT_MAX;
+                }
+                leaves.push_back(l);
+                lane = 0;
+            }
+            
+            BVH4Leaf &cur = leaves.back();
+            cur.pid[lane] = (unsigned int)pids[i];
+            if (p.t == sphere) {
+                for (int k = 0; k < 3; k ++)
+                    cur.a[k][lane] = p.sphere.c.s[k];
+                cur.r2[lane] = p.sphere.r * p.sphere.r;
+            } else {
+                const Vector e0 = p.triangle.p[1] - p.triangle.p[0];
+                const Vector e1 = p.triangle.p[2] - p.triangle.p[0];
+                for (int k = 0; k < 3; k ++) {
+                    cur.a[k][lane] = p.triangle.p[0].s[k];
+                    cur.b[k][lane] = e0.s[k];
+                    cur.c[k][lane] = e1.s[k];
+                }
+            }
+            lane ++;
+        }
+    }
+    
+    count = (int)leaves.size() - first;
+}
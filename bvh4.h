@@ -0,0 +1,205 @@
+//
+//  bvh4.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef __Oculus__bvh4__
+#define __Oculus__bvh4__
+
+#include "clcompat.h"
+#include "bvhtree.h"
+#include <vector>
+#include <xmmintrin.h>
+
+// 4 wide BVH for the CPU backend, collapsed from the binary BVHTree: a single
+// ray tests the four child boxes with one SSE slab test, and leaves keep up to
+// four primitives of the same type laid out for one SSE intersection
+struct BVH4Node {
+	float bmin[3][4];       // child boxes, per axis
+	float bmax[3][4];
+	int child[4];           // inner node or first leaf packet, -1 when empty
+	int count[4];           // leaf packets, 0 for inner nodes
+};
+
+struct BVH4Leaf {
+	float a[3][4];          // sphere centre, triangle p0
+	float b[3][4];          // triangle p1 - p0
+	float c[3][4];          // triangle p2 - p0
+	float r2[4];            // sphere radius squared, -FLT_MAX pads
+	unsigned int pid[4];    // P_NONE pads
+	int type;               // sphere or triangle, for the four lanes
+};
+
+struct BVH4 {
+	std::vector<BVH4Node> nodes;
+	std::vector<BVH4Leaf> leaves;
+	int depth;              // levels of inner nodes
+	int stackSize;          // traversal stack entries it can take, 3 per level
+
+	BVH4(const BVHTree *tree, const std::vector<Primitive> &primitives);
+	int Build(const BVHTreeNode *node, const std::vector<Primitive> &primitives, int level = 1);
+	void BuildLeaf(const std::vector<size_t> &pids, const std::vector<Primitive> &primitives, int &first, int &count);
+};
+
+// sphere_distance on the four lanes, same operations as the scalar test
+inline __m128 bvh4_spheres(const BVH4Leaf *l, const __m128 o[3], const __m128 d[3])
+{
+	const __m128 vx = _mm_sub_ps(_mm_loadu_ps(l->a[0]), o[0]);
+	const __m128 vy = _mm_sub_ps(_mm_loadu_ps(l->a[1]), o[1]);
+	const __m128 vz = _mm_sub_ps(_mm_loadu_ps(l->a[2]), o[2]);
+
+	const __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, d[0]), _mm_mul_ps(vy, d[1])), _mm_mul_ps(vz, d[2]));
+	const __m128 vv = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+	const __m128 disc = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b, b), vv), _mm_loadu_ps(l->r2));
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 miss = _mm_set1_ps(FLT_MAX);
+	const __m128 sq = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+	const __m128 t0 = _mm_sub_ps(b, sq);
+	const __m128 t1 = _mm_add_ps(b, sq);
+
+	// t0 when in front, else t1 when in front, else a miss
+	const __m128 m0 = _mm_cmplt_ps(zero, t0);
+	const __m128 m1 = _mm_cmplt_ps(zero, t1);
+	__m128 t = _mm_or_ps(_mm_and_ps(m1, t1), _mm_andnot_ps(m1, miss));
+	t = _mm_or_ps(_mm_and_ps(m0, t0), _mm_andnot_ps(m0, t));
+
+	const __m128 hit = _mm_cmple_ps(zero, disc);
+	return _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, miss));
+}
+
+// triangle_distance (Moller - Trumbore) on the four lanes
+inline __m128 bvh4_triangles(const BVH4Leaf *l, const __m128 o[3], const __m128 d[3])
+{
+	const __m128 e0x = _mm_loadu_ps(l->b[0]), e0y = _mm_loadu_ps(l->b[1]), e0z = _mm_loadu_ps(l->b[2]);
+	const __m128 e1x = _mm_loadu_ps(l->c[0]), e1y = _mm_loadu_ps(l->c[1]), e1z = _mm_loadu_ps(l->c[2]);
+
+	const __m128 ox = _mm_sub_ps(o[0], _mm_loadu_ps(l->a[0]));
+	const __m128 oy = _mm_sub_ps(o[1], _mm_loadu_ps(l->a[1]));
+	const __m128 oz = _mm_sub_ps(o[2], _mm_loadu_ps(l->a[2]));
+
+	// p = d x e1
+	const __m128 px = _mm_sub_ps(_mm_mul_ps(d[1], e1z), _mm_mul_ps(d[2], e1y));
+	const __m128 py = _mm_sub_ps(_mm_mul_ps(d[2], e1x), _mm_mul_ps(d[0], e1z));
+	const __m128 pz = _mm_sub_ps(_mm_mul_ps(d[0], e1y), _mm_mul_ps(d[1], e1x));
+
+	const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, e0x), _mm_mul_ps(py, e0y)), _mm_mul_ps(pz, e0z));
+	const __m128 absdet = _mm_andnot_ps(_mm_set1_ps(-0.f), det);
+	__m128 ok = _mm_cmple_ps(_mm_set1_ps(EPSILON), absdet);
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 u = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, ox), _mm_mul_ps(py, oy)), _mm_mul_ps(pz, oz)), det);
+	ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmple_ps(zero, u), _mm_cmple_ps(u, one)));
+
+	// q = o x e0
+	const __m128 qx = _mm_sub_ps(_mm_mul_ps(oy, e0z), _mm_mul_ps(oz, e0y));
+	const __m128 qy = _mm_sub_ps(_mm_mul_ps(oz, e0x), _mm_mul_ps(ox, e0z));
+	const __m128 qz = _mm_sub_ps(_mm_mul_ps(ox, e0y), _mm_mul_ps(oy, e0x));
+
+	const __m128 v = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, d[0]), _mm_mul_ps(qy, d[1])), _mm_mul_ps(qz, d[2])), det);
+	ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmple_ps(zero, v), _mm_cmple_ps(v, one)));
+
+	const __m128 t = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, e1x), _mm_mul_ps(qy, e1y)), _mm_mul_ps(qz, e1z)), det);
+	ok = _mm_and_ps(ok, _mm_cmplt_ps(zero, t));
+
+	return _mm_or_ps(_mm_and_ps(ok, t), _mm_andnot_ps(ok, _mm_set1_ps(FLT_MAX)));
+}
+
+// closest hit below *distance (any hit for shadow rays), same contract as scene_intersect
+inline bool bvh4_intersect(
+	const BVH4 *bvh,
+	const Ray *r,
+	unsigned int *pid,
+	float *distance,
+	bool shadow_ray)
+{
+	const __m128 o[3] = { _mm_set1_ps(r->o.x), _mm_set1_ps(r->o.y), _mm_set1_ps(r->o.z) };
+	const __m128 d[3] = { _mm_set1_ps(r->d.x), _mm_set1_ps(r->d.y), _mm_set1_ps(r->d.z) };
+	const __m128 inv[3] = {
+		_mm_set1_ps(1.f / r->d.x), _mm_set1_ps(1.f / r->d.y), _mm_set1_ps(1.f / r->d.z)
+	};
+
+	const BVH4Node *nodes = &bvh->nodes[0];
+	const BVH4Leaf *leaves = &bvh->leaves[0];
+	bool hit = false;
+
+	// a node takes one entry and gives back up to four, so 3 per level bound the
+	// stack; degenerate trees deeper than the fixed one use the heap
+	int fixed[64];
+	std::vector<int> deep;
+	int *stack = fixed;
+	if (bvh->stackSize > 64) {
+		deep.resize(bvh->stackSize);
+		stack = &deep[0];
+	}
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top) {
+		const BVH4Node *n = nodes + stack[--top];
+
+		// slab test of the four children at once
+		__m128 tmin = _mm_setzero_ps();
+		__m128 tmax = _mm_set1_ps(*distance);
+		for (int k = 0; k < 3; k ++) {
+			const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->bmin[k]), o[k]), inv[k]);
+			const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->bmax[k]), o[k]), inv[k]);
+			tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+		}
+		int mask = _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+		if (!mask)
+			continue;
+
+		float near[4];
+		_mm_storeu_ps(near, tmin);
+
+		// leaves right away, inner children pushed far to near
+		int order[4], inner = 0;
+		for (; mask; mask &= mask - 1) {
+			const int i = __builtin_ctz(mask);
+			if (n->child[i] < 0)
+				continue;
+			if (!n->count[i]) {
+				int j = inner++;
+				for (; j > 0 && near[order[j - 1]] < near[i]; j --)
+					order[j] = order[j - 1];
+				order[j] = i;
+				continue;
+			}
+
+			for (int p = n->child[i]; p < n->child[i] + n->count[i]; p ++) {
+				const BVH4Leaf *l = leaves + p;
+				const __m128 t = l->type == sphere ? bvh4_spheres(l, o, d) : bvh4_triangles(l, o, d);
+				int closer = _mm_movemask_ps(_mm_cmplt_ps(t, _mm_set1_ps(*distance)));
+				if (!closer)
+					continue;
+
+				hit = true;
+				if (shadow_ray)
+					return true;
+
+				float dist[4];
+				_mm_storeu_ps(dist, t);
+				for (; closer; closer &= closer - 1) {
+					const int j = __builtin_ctz(closer);
+					if (dist[j] < *distance) {
+						*distance = dist[j];
+						*pid = l->pid[j];
+					}
+				}
+			}
+		}
+
+		for (int j = 0; j < inner; j ++)
+			stack[top++] = n->child[order[j]];
+	}
+
+	return hit;
+}
+
+#endif /* defined(__Oculus__bvh4__) */
@@ -47,7 +47,14 @@ BVHTree::BVHTree(std::vector<Primitive>& primitives) {
     rootNode = Build(primitiveVec, 0, primitiveVec.size());
 //    rootNode = BuildAlt(primitiveVec, 0, primitiveVec.size() - 1);
     
-    bvh_vec_t list;
+    Serialize(BVH_LEAF_SIZE);
+}
+
+// flattens the tree into the skip list, subtrees of up to leafSize primitives
+// become a single leaf
+void BVHTree::Serialize(int leafSize) {
+    this->leafSize = leafSize;
+    bvh_vec.clear();
     cout << "bvh tree:" << endl;
     DumpTree(rootNode, bvh_vec);
 
@@ -57,11 +64,25 @@ BVHTree::BVHTree(std::vector<Primitive>& primitives) {
         cout << "[" << std::right << std::setw(2) << i << "] skip: " << std::left << std::setw(2) << bvh_vec[i].skip;
         if (bvh_vec[i].pid != P_NONE)
             cout << " leaf: " << bvh_vec[i].pid;
+        if (bvh_vec[i].count > 1)
+            cout << " (" << bvh_vec[i].count << " primitives)";
         cout << endl;
     }
 #endif
 }
 
+// primitives below node, stops counting past limit
+static void leafPrimitives(BVHTreeNode *node, std::vector<size_t> &pids, size_t limit) {
+    if (pids.size() > limit)
+        return;
+    if (node->isLeaf()) {
+        pids.push_back(node->primitiveIndex);
+        return;
+    }
+    leafPrimitives(node->left, pids, limit);
+    leafPrimitives(node->right, pids, limit);
+}
+
 BVHTreeNode *BVHTree::BuildAlt(node_vec_t &list, size_t start, size_t end, int axis) const {
     size_t d = end - start;
     
@@ -72,9 +93,10 @@ BVHTreeNode *BVHTree::BuildAlt(node_vec_t &list, size_t start, size_t end, int a
         return list[start];
     }
     
-    // calculate the union bounding box
+    // calculate the union bounding box, grown from the first child rather than the origin
     BVHTreeNode *node = new BVHTreeNode();
-    for (size_t i = start; i <= end; i ++) {
+    node->bbox = list[start]->bbox;
+    for (size_t i = start + 1; i <= end; i ++) {
         node->bbox += list[i]->bbox;
     }
 
@@ -104,6 +126,7 @@ BVHTreeNode *BVHTree::Build(node_vec_t &list, size_t start, size_t end) const {
     // calculate the union bounding box and the mean center
     Vector mean = vec_zero;
     BVHTreeNode *node = new BVHTreeNode();
+    node->bbox = list[start]->bbox;
     for (size_t i = start; i < end; i ++) {
         node->bbox += list[i]->bbox;
         mean = mean + list[i]->bbox.center();
@@ -155,8 +178,12 @@ void BVHTree::DumpTree(BVHTreeNode *node, bvh_vec_t& list, int depth) const {
     if (node == nullptr)
         return;
     
+    std::vector<size_t> pids;
+    leafPrimitives(node, pids, leafSize);
+    
     BVHNode n;
     n.pid = (unsigned int)node->primitiveIndex;
+    n.count = 0;
     n.min = node->bbox.min;
     n.max = node->bbox.max;
     size_t ofs = list.size();
@@ -167,10 +194,21 @@ void BVHTree::DumpTree(BVHTreeNode *node, bvh_vec_t& list, int depth) const {
     for(int i = depth; i; i--) cout << " |";
 #endif
     
-    if (node->isLeaf()) {
+    if (pids.size() <= (size_t)leafSize) {
 #ifdef DEBUG_BVH
-        cout << " leaf: " << node->primitiveIndex << endl;
+        cout << " leaf:";
+        for (size_t i = 0; i < pids.size(); i ++)
+            cout << " " << pids[i];
+        cout << endl;
 #endif
+        // the first node carries the box and the count, the rest only their pid
+        list[ofs].pid = (unsigned int)pids[0];
+        list[ofs].count = (unsigned int)pids.size();
+        n.skip = (unsigned int)(ofs + pids.size());
+        for (size_t i = 1; i < pids.size(); i ++) {
+            n.pid = (unsigned int)pids[i];
+            list.push_back(n);
+        }
     } else {
 #ifdef DEBUG_BVH
         cout << " node" << endl;
@@ -181,4 +219,3 @@ void BVHTree::DumpTree(BVHTreeNode *node, bvh_vec_t& list, int depth) const {
     
     list[ofs].skip = (unsigned int)list.size();
 }
-
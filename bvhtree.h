@@ -9,6 +9,7 @@
 #ifndef __Oculus__bvhtree__
 #define __Oculus__bvhtree__
 
+#include "defs.h"
 #include "geometry.h"
 #include "util.h"
 #include <vector>
@@ -72,8 +73,10 @@ struct BVHTree {
     std::vector<BVHTreeNode *> primitiveVec;
     BVHTreeNode *rootNode;
     bvh_vec_t bvh_vec;
+    int leafSize;
     
     BVHTree(std::vector<Primitive>& primitives);
+    void Serialize(int leafSize);
     BVHTreeNode *Build(node_vec_t &list, size_t start, size_t end) const;
     BVHTreeNode *BuildAlt(node_vec_t &list, size_t start, size_t end, int axis = 0) const;
     void DumpTree(BVHTreeNode *node, bvh_vec_t& list, int depth = 0) const;
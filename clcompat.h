@@ -0,0 +1,64 @@
+//
+//  clcompat.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef Oculus_clcompat_h
+#define Oculus_clcompat_h
+
+// the OpenCL C subset used by the kernel headers, so the CPU backend can
+// compile integrator.h as plain C++ on the host types of geometry.h
+
+#include "defs.h"
+#include "geometry.h"
+#include "util.h"
+#include <cmath>
+#include <cfloat>
+
+#define __global
+#define __local
+#define __constant static const
+
+#define EPSILON 1e-2f
+#define PI 3.14159265358979323846f
+
+typedef unsigned char uchar;
+typedef unsigned int uint;
+typedef unsigned long ulong;
+
+const Vector vec_y =	(Vector){{0.f, 1.f, 0.f}};
+const Vector vec_x =	(Vector){{1.f, 0.f, 0.f}};
+const Vector vec_one =	(Vector){{1.f, 1.f, 1.f}};
+const Vector ambient =	(Vector){{.1f, .1f, .1f}};
+
+inline float max(const float a, const float b) { return a > b ? a : b; }
+inline float min(const float a, const float b) { return a < b ? a : b; }
+inline float clamp(const float x, const float a, const float b) { return min(max(x, a), b); }
+inline float sign(const float x) { return x > 0.f ? 1.f : x < 0.f ? -1.f : 0.f; }
+inline float radians(const float d) { return d * (PI / 180.f); }
+
+inline float dot(const Vector &a, const Vector &b) {
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline Vector cross(const Vector &a, const Vector &b) {
+	return (Vector){{a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x}};
+}
+
+inline float length(const Vector &a) {
+	return sqrtf(dot(a, a));
+}
+
+inline Vector normalize(const Vector &a) {
+	return a / length(a);
+}
+
+// profiling counters, several threads share them
+inline uint atomic_inc(volatile uint *p) {
+	return __sync_fetch_and_add(p, 1);
+}
+
+#endif
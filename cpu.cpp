@@ -0,0 +1,208 @@
+//
+//  cpu.cpp
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#include "cpu.h"
+#include "clcompat.h"
+#include "sampler.h"
+#include "ray.h"
+
+// integrator.h compiled once per scene feature set, its functions become static
+// members and FEATURES the template argument, so the branches for missing
+// primitive and material types fold away
+#define FEATURES Features
+template <unsigned int Features>
+struct Integrator {
+#include "integrator.h"
+};
+#undef FEATURES
+
+typedef Integrator<FEATURE_ALL> Generic;
+
+#include "packet.h"
+#include <iostream>
+#include <string.h>
+
+CPU::CPU() {
+    hybrid = false;
+    int threads = std::thread::hardware_concurrency();
+    pool = new ThreadPool(threads > 0 ? threads : 1);
+    std::cout << "[CPU] Threads: " << pool->size() << std::endl;
+}
+
+CPU::~CPU() {
+    delete pool;
+    delete[] rgb;
+}
+
+// instantiations, tightest first
+#define VARIANT(f) { f, &CPU::renderPixels<f> }
+static const struct {
+    cl_uint features;
+    CPU::RenderFunc render;
+} variants[] = {
+    VARIANT(FEATURE_SPHERES | FEATURE_DIFFUSE),
+    VARIANT(FEATURE_TRIANGLES | FEATURE_DIFFUSE),
+    VARIANT(FEATURE_SPHERES | FEATURE_TRIANGLES | FEATURE_DIFFUSE),
+    VARIANT(FEATURE_ALL & ~FEATURE_DIELECTRIC),
+    VARIANT(FEATURE_ALL)
+};
+
+// nothing to compile, picks the first integrator covering the scene
+void CPU::createKernel() {
+    const cl_uint features = scene->features();
+    
+    int i = 0;
+    while (features & ~variants[i].features)
+        i ++;
+    render = variants[i].render;
+    
+    std::cout << "[CPU] Scene features: 0x" << std::hex << features
+              << ", integrator: 0x" << variants[i].features << std::dec << std::endl;
+}
+
+void CPU::createBuffers() {
+    frame.assign(width * height, vec_zero);
+    variance.assign(width * height, 0.f);
+    spp.assign(width * height, 0);
+    rgb = new Pixel[width * height];
+    
+    samples = 0;
+    converged = false;
+}
+
+// pixels traced together, blocks of 4x2 or 4x4 for the packets
+#ifdef PACKET_WIDTH
+#define BLOCK_W 4
+#define BLOCK_H (PACKET_WIDTH / BLOCK_W)
+#else
+#define BLOCK_W 1
+#define BLOCK_H 1
+#endif
+
+// the adaptive schedule and the raytracer kernel over a tile
+void CPU::renderTile(int x0, int y0, int x1, int y1) {
+    cl_uint active = 0;
+    
+    for (int by = y0; by < y1; by += BLOCK_H) {
+        for (int bx = x0; bx < x1; bx += BLOCK_W) {
+            cl_uint pixels[BLOCK_W * BLOCK_H];
+            int n = 0;
+            
+            // converged pixels keep their last value
+            for (int y = by; y < std::min(by + BLOCK_H, y1); y ++)
+                for (int x = bx; x < std::min(bx + BLOCK_W, x1); x ++)
+                    if (hybrid ? this->active[y * width + x] : Generic::pixel_active(&frame[0], &variance[0], &spp[0], y * width + x))
+                        pixels[n++] = y * width + x;
+            
+            if (n)
+                (this->*render)(pixels, n);
+            active += n;
+        }
+    }
+    
+    __sync_fetch_and_add(&counter.c[COUNTER_ACTIVE], active);
+}
+
+// launchSamples paths for each of the n pixels, the primary rays as one packet
+template <unsigned int Features>
+void CPU::renderPixels(const cl_uint *pixels, int n) {
+    typedef Integrator<Features> I;
+    
+    Primitive *primitives = &scene->primitive_vector[0];
+    const int numprimitives = (int)scene->primitive_vector.size();
+    BVHNode *bvh = &scene->bvhTree->bvh_vec[0];
+    
+    Vector sum[BLOCK_W * BLOCK_H];
+    float lum2[BLOCK_W * BLOCK_H];
+    for (int k = 0; k < n; k ++) {
+        sum[k] = vec_zero;
+        lum2[k] = 0.f;
+    }
+    
+    for (int i = 0; i < launchSamples; i ++) {
+        Ray ray[BLOCK_W * BLOCK_H];
+        PathState path[BLOCK_W * BLOCK_H];
+        
+        for (int k = 0; k < n; k ++) {
+            const cl_uint index = pixels[k];
+            Sampler smp = sampler_init(index, spp[index] + i, scene->seed);
+            
+            float dx = index % width + sampler_next(&smp) - 0.5f;
+            float dy = index / width + sampler_next(&smp) - 0.5f;
+            
+            ray[k] = I::camera_genray(&scene->camera, dx, dy, width, height);
+            I::path_init(&path[k], &smp);
+        }
+        
+#ifdef PACKET_WIDTH
+        RayPacket packet;
+        packet_init(&packet, ray, n);
+        const bool coherent = packet_intersect(&counter, primitives, bvh, &packet);
+        float distance[PACKET_WIDTH];
+        vstore(distance, packet.t);
+#endif
+        
+        for (int k = 0; k < n; k ++) {
+            bool alive = true;
+#ifdef PACKET_WIDTH
+            // the packet already found the primary hit, otherwise path_step traces it
+            if (coherent) {
+                path[k].depth--;
+                alive = packet.pid[k] != P_NONE &&
+                    I::path_shade(&counter, primitives, numprimitives, bvh, NULL, &ray[k], &path[k], primitives + packet.pid[k], distance[k]);
+            }
+#endif
+            if (alive)
+                while (I::path_step(&counter, primitives, numprimitives, bvh, NULL, &ray[k], &path[k]));
+            
+            const float lum = I::luminance(path[k].sample);
+            sum[k] = sum[k] + path[k].sample;
+            lum2[k] += lum * lum;
+        }
+    }
+    
+    for (int k = 0; k < n; k ++) {
+        const cl_uint index = pixels[k];
+        if (hybrid) {
+            accum[index] = (Accum){sum[k].x, sum[k].y, sum[k].z, lum2[k], (cl_uint)launchSamples};
+            continue;
+        }
+        I::film_merge(&frame[0], &variance[0], &spp[0], index, sum[k], lum2[k], launchSamples);
+        const Vector pixel = frame[index];
+        rgb[index].r = (cl_uchar)clamp(pixel.x * 256.f, 0.f, 255.f);
+        rgb[index].g = (cl_uchar)clamp(pixel.y * 256.f, 0.f, 255.f);
+        rgb[index].b = (cl_uchar)clamp(pixel.z * 256.f, 0.f, 255.f);
+    }
+}
+
+void CPU::executeKernel() {
+    samples += launchSamples;
+    memset(&counter, 0, sizeof(counter_t));
+    
+    for (int y = 0; y < height; y += CPU_TILE)
+        for (int x = 0; x < width; x += CPU_TILE)
+            pool->push(std::bind(&CPU::renderTile, this, x, y,
+                                 std::min(x + CPU_TILE, width), std::min(y + CPU_TILE, height)));
+    pool->wait();
+    
+    converged = (counter.c[COUNTER_ACTIVE] == 0);
+}
+
+void CPU::readFrame(Vector *frame) {
+    std::copy(this->frame.begin(), this->frame.end(), frame);
+}
+
+// the threads read the camera from the scene, only the film starts over
+void CPU::updateCamera() {
+    frame.assign(width * height, vec_zero);
+    variance.assign(width * height, 0.f);
+    spp.assign(width * height, 0);
+    
+    samples = 0;
+    converged = false;
+}
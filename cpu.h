@@ -0,0 +1,47 @@
+//
+//  cpu.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef __Oculus__cpu__
+#define __Oculus__cpu__
+
+#include "defs.h"
+#include "scene.h"
+#include "renderer.h"
+#include "threadpool.h"
+#include <vector>
+
+// native backend, runs the kernel integrator (integrator.h) on host threads
+struct CPU : public Renderer {
+	typedef void (CPU::*RenderFunc)(const cl_uint *pixels, int n);
+	
+	ThreadPool *pool;
+	RenderFunc render;      // integrator instantiation picked for the scene features
+	
+	// same film as the device buffers
+	std::vector<Vector> frame;
+	std::vector<float> variance;
+	std::vector<cl_uint> spp;
+	
+	// Hybrid: the device owns the film, pixels are traced when the device scheduled
+	// them and their samples go to accum for it to merge
+	bool hybrid;
+	std::vector<cl_uchar> active;
+	std::vector<Accum> accum;
+	
+	CPU();
+	~CPU();
+	void createKernel();
+	void createBuffers();
+	void executeKernel();
+	void renderTile(int x0, int y0, int x1, int y1);
+	template <unsigned int Features> void renderPixels(const cl_uint *pixels, int n);
+	void readFrame(Vector *frame);
+	void updateCamera();
+};
+
+#endif /* defined(__Oculus__cpu__) */
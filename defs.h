@@ -12,11 +12,83 @@
 //#define INTEROP
 #define MAIN_DEVICE CL_DEVICE_TYPE_CPU
 //#define DEBUG
+#ifndef SCENE_NO_BVH
 #define USE_BVH
+#endif
+#define BVH_LEAF_SIZE 1         // primitives per BVH leaf, unless the device profile says otherwise
+#ifndef BVH_TREELET
+#define BVH_TREELET 0           // top BVH nodes kept in local memory per work group, set by the device profile
+#endif
 //#define PROFILING
 #define DOWNSCALE 4
+#define SAMPLES_PER_LAUNCH 1
+#define PATH_DEPTH 5
+
+// persistent threads regenerating paths as soon as they terminate; the samples of a pixel
+// are summed with float CAS in whatever order they finish, so renders are not reproducible
+// bit for bit across runs or devices (the same samples are drawn, only rounding differs)
+//#define PERSISTENT
+#define PERSISTENT_LANES 256    // work items per compute unit
+
+// wavefront path tracer, stage kernels per bounce (overrides PERSISTENT)
+//#define WAVEFRONT
+#define WAVEFRONT_GROUP 64      // work group size of the sorting kernels
+#define RADIX_BITS 4            // ray sorting: key bits per radix pass
+#define RAY_KEY_BITS 24         // ray sorting: direction octant and origin cell
+#define SHADOW_CHUNK 8          // lights connected per pass, bounds the shadow ray buffer
+
+// per pixel adaptive sampling, pixels stop once their error is below threshold
+#define ADAPTIVE
+#define ADAPTIVE_MIN_SAMPLES 16
+#define ADAPTIVE_THRESHOLD 0.01f
+
+// native CPU backend (-cpu), image tiles handed to a work stealing thread pool
+#define CPU_TILE 16
+#define USE_PACKETS             // AVX2 / AVX-512 packets for the primary rays
+#define PACKET_COHERENCE 0.5f   // below this share of live lanes per node, rays go one by one
+#define INTERLEAVE_RAYS 8       // rays taking turns in the interleaved traversal (-bench)
+
+// several OpenCL devices on one image (-multi), bands of rows sized by device speed
+#define MULTI_MIN_ROWS 8        // smallest band of a device
+#define MULTI_REBALANCE 4       // bands move once a device would gain or lose this many rows
+
+// OpenCL device and CPU threads on the same image (-hybrid): both take tiles of CPU_TILE
+// rows from a shared queue, the device from the top and the threads from the bottom
+#define HYBRID_LAUNCHES 4       // device launches per frame, sets how many tiles it takes at once
+
+// kernel compiled for the loaded scene (types in use, light list, BVH), the generic
+// kernel is the fallback
+#define SPECIALISE_KERNEL
+#define SCENE_MAX_LIGHTS 16     // longer light lists scan the primitives instead
+#define BVH_MIN_PRIMITIVES 16   // smaller scenes are tested one primitive after another
+
+// compiled kernels are kept in this directory, keyed by a hash of the sources,
+// build options, device and driver
+#define KERNEL_CACHE "kernel_cache"
+
+// per device tuning (-tune): work group shape, build options and BVH leaf size are
+// swept on the loaded scene and the fastest stored here, later runs load it
+#define TUNING_PROFILE "oculus.profile"
+#define TUNE_LAUNCHES 4         // timed launches per configuration
+
+// scrambled Sobol sampler, otherwise plain random numbers
+#define USE_SOBOL
 
 #define BUFFER_CONST_TYPE __global
 //#define BUFFER_CONST_TYPE __constant
 
+// address space of each scene buffer; with PLACE_BUFFERS the host moves the ones that
+// fit the device's constant memory to __constant when building the specialised kernel
+#define PLACE_BUFFERS
+#define CONSTANT_RESERVE 4096   // constant memory bytes left for the kernel's own tables
+#ifndef PRIM_SPACE
+#define PRIM_SPACE BUFFER_CONST_TYPE
+#endif
+#ifndef BVH_SPACE
+#define BVH_SPACE BUFFER_CONST_TYPE
+#endif
+#ifndef CAMERA_SPACE
+#define CAMERA_SPACE BUFFER_CONST_TYPE
+#endif
+
 #endif
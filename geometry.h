@@ -11,6 +11,11 @@
 
 #define P_NONE UINT_MAX
 
+// counter_t slots
+#define COUNTER_ACTIVE 3    // pixels still being sampled
+#define COUNTER_WORK 4      // pixel samples handed out to persistent threads
+#define COUNTER_BOUNCE 5    // wavefront rays entering each bounce, up to the last slot (PROFILING)
+
 #ifdef __IS_KERNEL__
 
 #define EPSILON 1e-2f
@@ -24,7 +29,7 @@ typedef struct {
 
 typedef float2 textcoord_t;
 
-typedef uint2 random_state_t;
+#define make_vector(x, y, z) ((Vector)(x, y, z))
 
 __constant const Vector vec_zero =	(Vector)(0.f, 0.f, 0.f);
 __constant const Vector vec_y =		(Vector)(0.f, 1.f, 0.f);
@@ -35,6 +40,7 @@ __constant const Vector ambient =	(Vector)(.1f, .1f, .1f);
 typedef struct {
     uint pid;    // primitive index
     uint skip;   // the distance to the right node
+    uint count;  // leaf primitives, the pids of this node and the count - 1 following ones
     Vector min, max;
 } BVHNode;
 
@@ -44,7 +50,11 @@ typedef struct {
 
 #else
 
-#include <OpenCL/OpenCL.h>
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
 
 typedef cl_float3 Vector;
 
@@ -52,15 +62,18 @@ typedef struct {
 	cl_uchar r, g, b;
 } Pixel;
 
-typedef cl_uint2 random_state_t;
-
 typedef cl_float2 textcoord_t;
 
 const Vector vec_zero = (Vector){{0.f, 0.f, 0.f}};
 
+inline Vector make_vector(const float x, const float y, const float z) {
+	return (Vector){{x, y, z}};
+}
+
 typedef struct {
     cl_uint pid;    // primitive index
     cl_uint skip;   // the distance to the right node
+    cl_uint count;  // leaf primitives, the pids of this node and the count - 1 following ones
     Vector min, max;
 } BVHNode;
 
@@ -74,10 +87,58 @@ typedef struct {
 	Vector o, d;
 } Ray;
 
+// samples gathered by a launch for one pixel, merged into the frame afterwards
+typedef struct {
+	float r, g, b;
+	float l2;           // luminance squared sum
+	unsigned int n;
+} Accum;
+
+typedef struct {
+	unsigned int pixel;     // pixel index
+	unsigned int index;     // sample index in the pixel sequence
+	unsigned int dim;       // next dimension to draw
+	unsigned int seed;      // scene seed
+} Sampler;
+
+// path state between bounces, the ray itself is kept apart
+typedef struct {
+	Vector sample;          // radiance gathered so far
+	Vector illum;           // path throughput
+	Sampler smp;
+	unsigned int depth;     // bounces left
+	unsigned int bounce;    // lights count in full, primary or after a specular bounce
+} PathState;
+
+typedef struct {
+	unsigned int pid;       // primitive hit, P_NONE on a miss
+	float distance;
+} Hit;
+
+// light sample waiting for its occlusion test
+typedef struct {
+	Ray r;
+	Vector contribution;    // radiance added to the path when the light is visible
+	float distance;         // to the light
+	unsigned int path;
+} ShadowRay;
+
 typedef enum {
 	Diffuse, Specular, Dielectric, Metal
 } Surface;
 
+#define NUM_MATERIALS 4
+
+// primitive and material types present in a scene, an integrator built for a
+// subset drops the branches of the others (see FEATURES in primitives.h)
+#define FEATURE_SPHERES     1
+#define FEATURE_TRIANGLES   2
+#define FEATURE_DIFFUSE     4
+#define FEATURE_SPECULAR    8
+#define FEATURE_METAL       16
+#define FEATURE_DIELECTRIC  32
+#define FEATURE_ALL         63
+
 typedef struct {
 	Surface s;
 	Vector c;
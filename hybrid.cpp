@@ -0,0 +1,119 @@
+//
+//  hybrid.cpp
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#include "hybrid.h"
+#include <iostream>
+#include <algorithm>
+#include <stdlib.h>
+
+Hybrid::Hybrid() {
+#if defined(INTEROP) || defined(PERSISTENT) || defined(WAVEFRONT)
+    // the device traces bands of rows with the plain raytracer kernel
+    std::cout << "[Hybrid] Needs INTEROP, PERSISTENT and WAVEFRONT disabled" << std::endl;
+    exit(1);
+#endif
+    device = new OpenCL();
+    cpu = new CPU();
+    deviceTiles = 1;
+}
+
+Hybrid::~Hybrid() {
+    delete device;
+    delete cpu;
+}
+
+void Hybrid::createBuffers() {
+    Renderer *both[] = {device, cpu};
+    for (int i = 0; i < 2; i ++) {
+        both[i]->width = width;
+        both[i]->height = height;
+        both[i]->scene = scene;
+        both[i]->launchSamples = launchSamples;
+        both[i]->createBuffers();
+    }
+    cpu->hybrid = true;
+    cpu->active.assign(width * height, 0);
+    cpu->accum.assign(width * height, (Accum){0.f, 0.f, 0.f, 0.f, 0});
+    
+    image.assign(width * height, Pixel());
+    rgb = &image[0];
+    samples = 0;
+    converged = false;
+}
+
+void Hybrid::createKernel() {
+    device->createKernel();
+    cpu->createKernel();
+}
+
+// up to count tiles from the top or the bottom of the queue
+bool Hybrid::take(bool top, int count, int &first, int &taken) {
+    std::lock_guard<std::mutex> guard(lock);
+    taken = std::min(count, back - front);
+    if (taken <= 0)
+        return false;
+    if (top) {
+        first = front;
+        front += taken;
+    } else {
+        back -= taken;
+        first = back;
+    }
+    return true;
+}
+
+// a pool thread, tile after tile until the queue is empty
+void Hybrid::cpuWorker() {
+    int tile, taken;
+    while (take(false, 1, tile, taken)) {
+        const int y0 = tile * CPU_TILE, y1 = std::min(y0 + CPU_TILE, height);
+        std::fill(cpu->accum.begin() + y0 * width, cpu->accum.begin() + y1 * width, (Accum){0.f, 0.f, 0.f, 0.f, 0});
+        cpu->renderTile(0, y0, width, y1);
+    }
+}
+
+void Hybrid::executeKernel() {
+#ifndef INTEROP
+    device->scheduleFrame(&cpu->active[0], &cpu->spp[0]);
+    
+    const int tiles = (height + CPU_TILE - 1) / CPU_TILE;
+    front = 0;
+    back = tiles;
+    for (int i = 0; i < cpu->pool->size(); i ++)
+        cpu->pool->push(std::bind(&Hybrid::cpuWorker, this));
+    
+    // the host thread only feeds the device, runs of tiles one launch at a time
+    int tile, taken, done = 0;
+    while (take(true, deviceTiles, tile, taken)) {
+        device->traceRows(tile * CPU_TILE, std::min(taken * CPU_TILE, height - tile * CPU_TILE));
+        done += taken;
+    }
+    cpu->pool->wait();
+    
+    // the device gets through its share in about HYBRID_LAUNCHES runs next frame
+    deviceTiles = std::max(1, done / HYBRID_LAUNCHES);
+    
+    // the threads took the bottom rows
+    const int y0 = std::min(front * CPU_TILE, height);
+    device->resolveRows(&cpu->accum[0], y0, height - y0, &image[0]);
+    
+    counter = device->counter;
+    converged = device->converged;
+    samples = device->samples;
+#endif
+}
+
+void Hybrid::readFrame(Vector *frame) {
+    device->readFrame(frame);
+}
+
+void Hybrid::updateCamera() {
+    device->updateCamera();
+    samples = 0;
+    converged = false;
+}
@@ -0,0 +1,42 @@
+//
+//  hybrid.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef __Oculus__hybrid__
+#define __Oculus__hybrid__
+
+#include "defs.h"
+#include "opencl.h"
+#include "cpu.h"
+#include <vector>
+#include <mutex>
+
+// the OpenCL device and the CPU threads render the same frame (-hybrid): the image is
+// a queue of tiles of CPU_TILE rows, the device takes runs of them from the top and
+// every thread single tiles from the bottom until they meet; the threads' samples
+// are merged into the device film by film_resolve
+struct Hybrid : public Renderer {
+	OpenCL *device;
+	CPU *cpu;
+	std::vector<Pixel> image;
+	
+	std::mutex lock;
+	int front, back;        // tiles not taken yet, [front, back)
+	int deviceTiles;        // tiles the device takes at once
+	
+	Hybrid();
+	~Hybrid();
+	void createKernel();
+	void createBuffers();
+	void executeKernel();
+	void readFrame(Vector *frame);
+	void updateCamera();
+	bool take(bool top, int count, int &first, int &taken);
+	void cpuWorker();
+};
+
+#endif /* defined(__Oculus__hybrid__) */
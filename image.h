@@ -0,0 +1,66 @@
+//
+//  image.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef Oculus_image_h
+#define Oculus_image_h
+
+#include "geometry.h"
+#include <cstdio>
+#include <cmath>
+#include <vector>
+
+// float RGB image, rows bottom to top as in the frame buffer
+static bool writePFM(const char *f, const Vector *frame, int width, int height) {
+    FILE *fp = fopen(f, "wb");
+    if (!fp)
+        return false;
+    
+    fprintf(fp, "PF\n%d %d\n-1.0\n", width, height);
+    for (int i = 0; i < width * height; i ++)
+        fwrite(frame[i].s, sizeof(cl_float), 3, fp);
+    fclose(fp);
+    
+    return true;
+}
+
+static bool readPFM(const char *f, std::vector<Vector>& frame, int &width, int &height) {
+    FILE *fp = fopen(f, "rb");
+    if (!fp)
+        return false;
+    
+    float scale;
+    if (fscanf(fp, "PF %d %d %f", &width, &height, &scale) != 3 || scale > 0.f) {
+        fclose(fp);
+        return false;
+    }
+    fgetc(fp);
+    
+    frame.resize(width * height);
+    for (int i = 0; i < width * height; i ++) {
+        if (fread(frame[i].s, sizeof(cl_float), 3, fp) != 3) {
+            fclose(fp);
+            return false;
+        }
+    }
+    fclose(fp);
+    
+    return true;
+}
+
+static double rmse(const Vector *a, const Vector *b, size_t n) {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i ++)
+        for (int j = 0; j < 3; j ++) {
+            double d = a[i].s[j] - b[i].s[j];
+            sum += d * d;
+        }
+    
+    return sqrt(sum / (3 * n));
+}
+
+#endif
@@ -0,0 +1,515 @@
+//
+//  integrator.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef Oculus_integrator_h
+#define Oculus_integrator_h
+
+// path tracing integrator, shared by the kernels and the native CPU backend
+// (compiled as C++ on top of clcompat.h)
+
+#include "geometry.h"
+#include "primitives.h"
+#include "sampler.h"
+#include "ray.h"
+
+#ifdef PROFILING
+#define COUNTER(i) atomic_inc(&counter->c[i]);
+#else
+#define COUNTER(i)
+#endif
+
+// lights: the list baked into a specialised kernel, otherwise every primitive is
+// checked for emission
+#ifdef SCENE_LIGHTS
+__constant uint scene_lights[] = { SCENE_LIGHTS };
+#define LIGHT_COUNT(numprimitives) NUM_LIGHTS
+#define LIGHT(primitives, i) ((primitives) + scene_lights[i])
+#else
+#define LIGHT_COUNT(numprimitives) (numprimitives)
+#define LIGHT(primitives, i) ((primitives) + (i))
+#endif
+
+#ifdef USE_BVH
+// the first BVH_TREELET nodes of the skip list, the root and the subtrees it reaches
+// first, are copied to local memory by the work group at kernel start
+static inline BVHNode bvh_node(BVH_SPACE BVHNode *bvh, __local BVHNode *treelet, const int i)
+{
+#if BVH_TREELET
+    if (i < BVH_TREELET)
+        return treelet[i];
+#endif
+    return bvh[i];
+}
+
+static inline bool bvh_intersect(const Ray *r, const BVHNode *bvh)
+{
+    float t0 = -0.f;
+    float t1 = FLT_MAX;
+    
+    Vector bmin = bvh->min;
+    Vector bmax = bvh->max;
+    
+    float tmin, tmax, tymin, tymax, tzmin, tzmax;
+    if (r->d.x >= 0) {
+        tmin = (bmin.x - r->o.x) / r->d.x;
+        tmax = (bmax.x - r->o.x) / r->d.x;
+    }
+    else {
+        tmin = (bmax.x - r->o.x) / r->d.x;
+        tmax = (bmin.x - r->o.x) / r->d.x;
+    }
+    if (r->d.y >= 0) {
+        tymin = (bmin.y - r->o.y) / r->d.y;
+        tymax = (bmax.y - r->o.y) / r->d.y;
+    }
+    else {
+        tymin = (bmax.y - r->o.y) / r->d.y;
+        tymax = (bmin.y - r->o.y) / r->d.y;
+    }
+    if ( (tmin > tymax) || (tymin > tmax) )
+        return false;
+    if (tymin > tmin)
+        tmin = tymin;
+    if (tymax < tmax)
+        tmax = tymax;
+    if (r->d.z >= 0) {
+        tzmin = (bmin.z - r->o.z) / r->d.z;
+        tzmax = (bmax.z - r->o.z) / r->d.z;
+    }
+    else {
+        tzmin = (bmax.z - r->o.z) / r->d.z;
+        tzmax = (bmin.z - r->o.z) / r->d.z;
+    }
+    if ( (tmin > tzmax) || (tzmin > tmax) )
+        return false;
+    if (tzmin > tmin)
+        tmin = tzmin;
+    if (tzmax < tmax)
+        tmax = tzmax;
+    return ( (tmin < t1) && (tmax > t0) );
+}
+
+#endif
+
+static bool scene_intersect(
+    __global counter_t *counter,
+    PRIM_SPACE Primitive *primitives,
+    const int numprimitives,
+    const Ray *r,
+    PRIM_SPACE Primitive **s,
+    BVH_SPACE BVHNode *bvh,
+    __local BVHNode *treelet,
+    float *distance,
+    bool shadow_ray)
+{
+    bool hit = false;
+    
+#ifdef USE_BVH
+    int cur = 0;
+    int end = bvh->skip;
+    
+    while (cur < end) {
+        const BVHNode n = bvh_node(bvh, treelet, cur);
+        COUNTER(1);
+        if (bvh_intersect(r, &n)) {
+            if (n.pid == P_NONE) {
+                cur ++;
+                continue;
+            }
+            for (uint i = 0; i < n.count; i ++) {
+                PRIM_SPACE Primitive *p = primitives + (i ? bvh_node(bvh, treelet, cur + i).pid : n.pid);
+                COUNTER(2);
+                const float d = primitive_distance(p, r);
+                if (d < *distance) {
+                    if (shadow_ray) return true;
+                    hit = true;
+                    *distance = d;
+                    *s = p;
+                }
+            }
+        }
+        cur = n.skip;
+    }
+#else
+    for (int i = 0; i < numprimitives; i++) {
+        PRIM_SPACE Primitive *p = primitives + i;
+        COUNTER(2);
+        const float d = primitive_distance(p, r);
+        if (d < *distance) {
+            hit = true;
+            if (shadow_ray) break;
+            *distance = d;
+            *s = p;
+        }
+	}
+#endif
+    
+	return hit;
+}
+
+static inline float kdiff_lambert(const Ray *i, const Ray *o, const Vector normal)
+{
+	return max(0.f, dot(i->d, normal));
+}
+
+// http://en.wikipedia.org/wiki/Blinn%E2%80%93Phong_shading_model
+static inline float kspec_blinnphong(const Ray *i, const Ray *o, const Vector normal, const Vector t)
+{
+	const float nshiny = 4.f;
+	const Vector h = normalize(i->d + o->d);
+	
+	return pow(dot(normal, h), nshiny);
+}
+/*
+static inline float kspec_gaussian(const Ray *i, const Ray *o, const Vector normal, const Vector t)
+{
+	const float m = 0.7f;
+	const Vector h = normalize(i->d + o->d);
+	float a = acos(dot(normal, h));
+	
+	return exp(-1.f * pow(a / m, 2));
+}
+
+static inline float kspec_beckmann(const Ray *i, const Ray *o, const Vector normal, const Vector t)
+{
+	const float m = 0.7f;
+	const Vector h = normalize(i->d + o->d);
+	float a = acos(dot(normal, h));
+	float cos_a2 = cos(a) * cos(a);
+	float e = (1.f - cos_a2) / (cos_a2 * m * m);
+	
+	return exp(-1.f * e) / (PI * m * m * cos_a2 * cos_a2);
+}
+
+static inline float kspec_heidrich_seidel(const Ray *i, const Ray *o, const Vector normal, const Vector t)
+{
+	const float ka = 1e3f;
+	const float a = dot(i->d, t);
+	const float b = dot(o->d, t);
+
+	return pow(sin(a)*sin(b) + cos(a)*cos(b), ka) * kspec_blinnphong(i, o, normal, t);
+}
+*/
+static inline Vector light_tangent(const Ray *r, const Vector normal, const float cos_i)
+{
+	return cross(normal, normalize(r->d + 2.f * cos_i * normal));
+}
+
+// shadow ray towards a random point of light l
+static inline Ray light_ray(
+	PRIM_SPACE Primitive *l,
+	Sampler *smp,
+	const Vector hit_point,
+	const Vector normal,
+	float *light_dist
+	)
+{
+	const float u = sampler_next(smp);
+	const float v = sampler_next(smp);
+	Vector light_hit = primitive_surfacepoint(l, u, v) - normal * EPSILON; // make sure it won't collide with the primitive
+	
+	Ray s_ray = {hit_point + normal * EPSILON, normalize(light_hit - hit_point)};
+	*light_dist = length(light_hit - hit_point);
+	return s_ray;
+}
+
+// light arriving through an unoccluded shadow ray
+static inline Vector light_contribution(
+	PRIM_SPACE Primitive *l,
+	const Ray *s_ray,
+	const Ray *r,
+	const Vector normal,
+	const Vector tangent,
+	const float light_dist
+	)
+{
+	Vector emission = l->m.c * l->m.e;
+	
+	// Phong illumination model http://en.wikipedia.org/wiki/Phong_reflection_model
+	float attenuation = 2.f * sqrt(light_dist);
+	float kdiff = kdiff_lambert(s_ray, r, normal);
+	float kspec = kspec_blinnphong(s_ray, r, normal, tangent);
+	
+	return emission * (kdiff + kspec) / attenuation;
+}
+
+static Vector scene_illumination(
+    __global counter_t *counter,
+	PRIM_SPACE Primitive *primitives,
+	const int numprimitives,
+	Sampler *smp,
+	
+	PRIM_SPACE Primitive *s,
+	const Ray *r,
+	const Vector hit_point,
+	const Vector normal,
+	const float cos_i,
+	BVH_SPACE BVHNode *bvh,
+	__local BVHNode *treelet
+	)
+{
+	Vector illu = vec_zero;
+	Vector tangent = light_tangent(r, normal, cos_i);
+	
+	for (int i = 0; i < LIGHT_COUNT(numprimitives); i++) {
+		PRIM_SPACE Primitive *l = LIGHT(primitives, i);
+		if (l->m.e != 0.f) {
+            float light_dist;
+			Ray s_ray = light_ray(l, smp, hit_point, normal, &light_dist);
+
+			PRIM_SPACE Primitive *h;
+			bool hit = scene_intersect(counter, primitives, numprimitives, &s_ray, &h, bvh, treelet, &light_dist, true);
+			if (!hit)
+				illu = illu + light_contribution(l, &s_ray, r, normal, tangent, light_dist);
+		}
+	}
+	
+	return illu + ambient;
+}
+
+static inline void path_init(PathState *path, const Sampler *smp)
+{
+	path->sample = vec_zero;
+	path->illum = vec_one;
+	path->smp = *smp;
+	path->depth = PATH_DEPTH;
+	path->bounce = true;
+}
+
+// hit point and normal facing the incoming ray
+static inline void hit_setup(
+	PRIM_SPACE Primitive *s,
+	const Ray *r,
+	const float distance,
+	Vector *hit_point,
+	Vector *normal,
+	float *cos_i,
+	bool *leaving)
+{
+	*hit_point = r->o + r->d * distance;
+	*normal = primitive_normal(s, *hit_point);
+	
+	// correct normals, simt style
+	*cos_i = -1.f * dot(*normal, normalize(r->d));
+	float csign = sign(*cos_i);
+
+	*normal = *normal * csign;
+	*cos_i = *cos_i * csign;
+	*leaving = (csign < 0.f);
+}
+
+// BRDFs, direct lighting for diffuse surfaces is sampled separately by scene_illumination
+static inline void material_diffuse(PathState *path, Ray *r, const Vector hit_point, const Vector normal)
+{
+	path->bounce = false;
+	ray_bounce(r, hit_point, normal, &path->smp);
+}
+
+static inline void material_specular(PathState *path, Ray *r, const Vector hit_point, const Vector normal, const float cos_i)
+{
+	path->bounce = true;
+	ray_reflection(r, hit_point, normal, cos_i);
+}
+
+static inline void material_metal(PathState *path, Ray *r, const Vector hit_point, const Vector normal, const float cos_i)
+{
+	path->bounce = true;
+	ray_reflection(r, hit_point, normal, cos_i);
+}
+
+static inline void material_dielectric(PathState *path, Ray *r, const Vector hit_point, const Vector normal, const float cos_i, const bool leaving)
+{
+	path->bounce = true;
+
+	const float air = 1.f;
+	const float glass = 1.5f;
+
+	float n1 = leaving? glass : air;
+	float n2 = leaving? air : glass;
+	float n = n1 / n2;
+
+	float cos_t2 = 1.f - pow(n, 2) * (1.f - pow(cos_i, 2));
+
+	if (cos_t2 < 0.f) {
+		ray_reflection(r, hit_point, normal, cos_i);
+	} else {
+		float cos_t = sqrt(cos_t2);
+
+		// TODO: implement Schlick approx.
+		float perp = pow((n1 * cos_i - n2 * cos_t) / (n1 * cos_i + n2 * cos_t), 2.f);
+		float para = pow((n2 * cos_i - n1 * cos_t) / (n2 * cos_i + n1 * cos_t), 2.f);
+		float fres = (perp + para) / 2.f;
+		
+		if (sampler_next(&path->smp) < fres) {
+			ray_reflection(r, hit_point, normal, cos_i);
+		} else {
+			ray_refraction(r, hit_point, normal, cos_i, cos_t, n);
+		}
+	}
+}
+
+// shades the hit of the current bounce, returns false once the path has terminated
+static bool path_shade(
+    __global counter_t *counter,
+	PRIM_SPACE Primitive *primitives,
+	const int numprimitives,
+	BVH_SPACE BVHNode *bvh,
+	__local BVHNode *treelet,
+	Ray *r,
+	PathState *path,
+	PRIM_SPACE Primitive *s,
+	const float distance
+)
+{
+	// Lights
+	if (s->m.e != 0.f) {
+		// HACK?: only return full luminance when either hit by a primary ray or
+		// after a specular bounce, as diffuse already sampled it previously
+		if (path->bounce)
+			path->sample = path->sample + path->illum * s->m.e * s->m.c;
+		return false;
+	} 
+
+	// intersection
+	Vector hit_point, normal;
+	float cos_i;
+	bool leaving;
+	hit_setup(s, r, distance, &hit_point, &normal, &cos_i, &leaving);
+	Surface material = s->m.s;
+	
+	path->illum = path->illum * s->m.c;
+
+	// Avoiding switch decreases 8% frame time!
+	if ((FEATURES & FEATURE_DIFFUSE) && material == Diffuse) {
+		path->sample = path->sample + path->illum * scene_illumination(counter, primitives, numprimitives, &path->smp, s, r, hit_point, normal, cos_i, bvh, treelet);
+		material_diffuse(path, r, hit_point, normal);
+	} 
+	else if ((FEATURES & FEATURE_METAL) && material == Metal) {
+		//sample = sample + illum * scene_illumination(primitives, numprimitives, rnd, s, &r, hit_point, normal, cos_i, bvh, treelet);
+		material_metal(path, r, hit_point, normal, cos_i);
+	}
+	else if ((FEATURES & FEATURE_SPECULAR) && material == Specular) {
+		material_specular(path, r, hit_point, normal, cos_i);
+	}
+	else if ((FEATURES & FEATURE_DIELECTRIC) && material == Dielectric) {
+		material_dielectric(path, r, hit_point, normal, cos_i, leaving);
+	} 
+
+	return true;
+}
+
+// traces one bounce of the path, returns false once it has terminated
+static bool path_step(
+    __global counter_t *counter,
+	PRIM_SPACE Primitive *primitives,
+	const int numprimitives,
+	BVH_SPACE BVHNode *bvh,
+	__local BVHNode *treelet,
+	Ray *r,
+	PathState *path
+)
+{
+	if (path->depth == 0)
+		return false;
+	path->depth--;
+
+	PRIM_SPACE Primitive *s = 0;
+	float distance = FLT_MAX;
+	bool hit = scene_intersect(counter, primitives, numprimitives, r, &s, bvh, treelet, &distance, false);
+	if (!hit) {
+		return false;
+	}
+	
+	return path_shade(counter, primitives, numprimitives, bvh, treelet, r, path, s, distance);
+}
+
+static Vector scene_sample(
+    __global counter_t *counter,
+	PRIM_SPACE Primitive *primitives,
+	const int numprimitives,
+	Sampler *smp,
+	const Ray *ray,
+	BVH_SPACE BVHNode *bvh,
+	__local BVHNode *treelet
+)
+{
+	PathState path;
+	Ray r = *ray;
+	path_init(&path, smp);
+	
+	while (path_step(counter, primitives, numprimitives, bvh, treelet, &r, &path));
+
+	return path.sample;
+}
+
+static Ray camera_genray(CAMERA_SPACE Camera *camera, float x, float y, int width, int height)
+{
+	const float fov = radians(45.f);
+	const float fx = (float)x / width - 0.5f;
+	const float fy = (float)y / height - 0.5f;
+	const float zoom = 1.f;
+
+	Vector d = normalize(camera->t - camera->o);
+	Vector vx = normalize(cross(d, vec_y)) * (width * fov / height);
+	Vector vy = normalize(cross(vx, d)) * fov;
+	
+	return (Ray){camera->o, normalize(d + zoom * vx * fx + zoom * vy * fy)};
+}
+
+static inline float luminance(const Vector c)
+{
+	return dot(c, make_vector(0.2126f, 0.7152f, 0.0722f));
+}
+
+// merges a batch of n samples into the running pixel mean and luminance variance (Chan et al.)
+static void film_merge(
+	__global Vector *frame,
+	__global float *variance,
+	__global uint *spp,
+	const uint index,
+	const Vector sum,
+	const float lum2,
+	const uint n)
+{
+	const uint na = spp[index];
+	const uint nt = na + n;
+	const Vector mean_b = sum / (float)n;
+	const float lum_b = luminance(mean_b);
+	const float m2_b = max(0.f, lum2 - n * lum_b * lum_b);
+
+	if (na == 0) {
+		frame[index] = mean_b;
+		variance[index] = m2_b;
+	} else {
+		const Vector mean_a = frame[index];
+		const float delta = lum_b - luminance(mean_a);
+		frame[index] = mean_a + (mean_b - mean_a) * ((float)n / nt);
+		variance[index] += m2_b + delta * delta * ((float)na * n / nt);
+	}
+	spp[index] = nt;
+}
+
+// adaptive sampling, whether the pixel error is still above the threshold
+static inline bool pixel_active(
+	__global const Vector *frame,
+	__global const float *variance,
+	__global const uint *spp,
+	const uint index)
+{
+#ifdef ADAPTIVE
+	const uint n = spp[index];
+	if (n >= ADAPTIVE_MIN_SAMPLES) {
+		// standard error of the luminance mean, relative to the pixel brightness
+		const float error = sqrt(variance[index] / (n * (n - 1.f)));
+		return error > ADAPTIVE_THRESHOLD * max(luminance(frame[index]), 1e-2f);
+	}
+#endif
+	return true;
+}
+
+#endif
@@ -0,0 +1,122 @@
+//
+//  interleave.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef Oculus_interleave_h
+#define Oculus_interleave_h
+
+// interleaved traversal of the skip list BVH for the CPU backend: INTERLEAVE_RAYS
+// independent rays take turns one node at a time, and each prefetches what it
+// reads next before handing over, so the cache misses of huge scenes overlap
+// instead of stalling every ray in turn. Included after integrator.h, same hits
+// as scene_intersect.
+
+#if defined(USE_BVH)
+
+#include <xmmintrin.h>
+
+typedef struct {
+	Ray r;
+	unsigned int ray;       // index in the batch
+	unsigned int cur, end;  // skip list position
+	unsigned int pid;       // closest primitive so far
+	float distance;
+	unsigned int test;      // box of a leaf hit, its primitives left to test one per turn
+} TraversalState;
+
+inline void traversal_init(TraversalState *s, const Ray *rays, const unsigned int ray, BVH_SPACE BVHNode *bvh)
+{
+	s->r = rays[ray];
+	s->ray = ray;
+	s->cur = 0;
+	s->end = bvh->skip;
+	s->pid = P_NONE;
+	s->distance = FLT_MAX;
+	s->test = 0;
+}
+
+// one turn of a ray: a box or a primitive test, then the prefetch of the next one
+inline bool traversal_step(
+	__global counter_t *counter,
+	PRIM_SPACE Primitive *primitives,
+	BVH_SPACE BVHNode *bvh,
+	TraversalState *s)
+{
+	BVH_SPACE BVHNode *n = bvh + s->cur;
+	
+	if (s->test) {
+		BVH_SPACE BVHNode *l = n + n->count - s->test;
+		COUNTER(2);
+		const float d = primitive_distance(primitives + l->pid, &s->r);
+		if (d < s->distance) {
+			s->distance = d;
+			s->pid = l->pid;
+		}
+		if (--s->test) {
+			_mm_prefetch((const char *)(primitives + l[1].pid), _MM_HINT_T0);
+			return true;
+		}
+		s->cur = n->skip;
+	} else {
+		COUNTER(1);
+		if (bvh_intersect(&s->r, n)) {
+			if (n->pid != P_NONE) {
+				s->test = n->count;
+				_mm_prefetch((const char *)(primitives + n->pid), _MM_HINT_T0);
+				return true;
+			}
+			s->cur ++;
+		} else {
+			s->cur = n->skip;
+		}
+	}
+	
+	if (s->cur >= s->end)
+		return false;
+	
+	_mm_prefetch((const char *)(bvh + s->cur), _MM_HINT_T0);
+	return true;
+}
+
+// closest hits of n rays, advanced round robin
+static void interleaved_intersect(
+	__global counter_t *counter,
+	PRIM_SPACE Primitive *primitives,
+	BVH_SPACE BVHNode *bvh,
+	const Ray *rays,
+	Hit *hits,
+	const unsigned int n)
+{
+	TraversalState state[INTERLEAVE_RAYS];
+	unsigned int live = 0;
+	unsigned int next = 0;
+	
+	while (live < INTERLEAVE_RAYS && next < n)
+		traversal_init(state + live++, rays, next++, bvh);
+	
+	while (live) {
+		for (unsigned int k = 0; k < live; ) {
+			TraversalState *s = state + k;
+			if (traversal_step(counter, primitives, bvh, s)) {
+				k ++;
+				continue;
+			}
+			
+			// finished, the slot takes the next ray or the last live one
+			hits[s->ray].pid = s->pid;
+			hits[s->ray].distance = s->distance;
+			if (next < n)
+				traversal_init(s, rays, next++, bvh);
+			else
+				*s = state[--live];
+		}
+	}
+}
+
+#endif
+
+#endif
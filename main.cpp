@@ -8,13 +8,25 @@
 
 #include "defs.h"
 #include "scene.h"
+#include "cpu.h"
+#include "bench.h"
+#ifndef CPU_ONLY
 #include "opencl.h"
+#include "multidevice.h"
+#include "hybrid.h"
+#endif
 #include "util.h"
+#include "image.h"
+#ifdef __APPLE__
 #include <GLUT/GLUT.h>
+#else
+#include <GL/glut.h>
+#endif
 #include <sys/time.h>
+#include <string.h>
 
 // main object
-OpenCL * openCL;
+Renderer * renderer;
 
 // GLUT, OpenGL related functions
 char label[256];
@@ -34,12 +46,12 @@ void display() {
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT);
     
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, openCL->textid);
+	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, renderer->textid);
 	glBegin(GL_QUADS);
 	glTexCoord2f(0.0f, 0.0f); glVertex2f(0.0f, 0.0f);
-	glTexCoord2f(openCL->width - 1.0f, 0.0f); glVertex2f(screen_w - 1.0f, 0.0f);
-	glTexCoord2f(openCL->width - 1.0f, openCL->height - 1.0f); glVertex2f(screen_w - 1.0f, screen_h - 1.0f);
-	glTexCoord2f(0.0f, openCL->height - 1.0f); glVertex2f(0.0f,  screen_h - 1.0f);
+	glTexCoord2f(renderer->width - 1.0f, 0.0f); glVertex2f(screen_w - 1.0f, 0.0f);
+	glTexCoord2f(renderer->width - 1.0f, renderer->height - 1.0f); glVertex2f(screen_w - 1.0f, screen_h - 1.0f);
+	glTexCoord2f(0.0f, renderer->height - 1.0f); glVertex2f(0.0f,  screen_h - 1.0f);
 	glEnd();
 	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, 0);
     
@@ -57,39 +69,80 @@ void display() {
 	glutSwapBuffers();
 }
 
+void idle();
+
 void keyboard(unsigned char key, int x, int y) {
 	switch(key) {
 		case 27: exit(0);
-		default: break;
+		// camera edits, the film starts over while rendering goes on
+		case 'a': renderer->scene->orbitCamera(-0.05f, 1.f); break;
+		case 'd': renderer->scene->orbitCamera(0.05f, 1.f); break;
+		case 'w': renderer->scene->orbitCamera(0.f, 0.95f); break;
+		case 's': renderer->scene->orbitCamera(0.f, 1.05f); break;
+		default: return;
 	}
+	renderer->updateCamera();
+	glutIdleFunc(idle);
 }
 
+#if defined(WAVEFRONT) && defined(PROFILING)
+// average per sample pass; sorting pays off when the extend time it saves
+// is larger than its own cost
+void raySortReport() {
+#ifndef CPU_ONLY
+	OpenCL *openCL = dynamic_cast<OpenCL *>(renderer);
+	if (!openCL || !openCL->profiledPasses[0] || !openCL->profiledPasses[1])
+		return;
+	double unsorted = 1e-6 * openCL->extendTime[0] / openCL->profiledPasses[0];
+	double sorted = 1e-6 * openCL->extendTime[1] / openCL->profiledPasses[1];
+	double sort = 1e-6 * openCL->sortTime / openCL->profiledPasses[1];
+	printf("# extend: %.2fms unsorted, %.2fms sorted (%.2fx), sort: %.2fms, net: %+.2fms\n",
+		   unsorted, sorted, unsorted / sorted, sort, unsorted - sorted - sort);
+#endif
+}
+#endif
+
 void idle() {
 	double tick = wallclock();
     
-	openCL->executeKernel();
+	renderer->executeKernel();
     
 	float seconds = 1000.f * (wallclock() - tick);
-	sprintf(label, "size: (%d, %d), prim: %ld, samples: %d, frame: %0.2fms",
-            openCL->width,
-            openCL->height,
-            openCL->scene->primitive_vector.size(),
-            openCL->samples,
+	sprintf(label, "size: (%d, %d), prim: %ld, samples: %d, active: %d, frame: %0.2fms",
+            renderer->width,
+            renderer->height,
+            renderer->scene->primitive_vector.size(),
+            renderer->samples,
+            renderer->counter.c[COUNTER_ACTIVE],
             seconds);
 	printf("%s # counter: %i %.2f %.2f\n",
            label,
-           openCL->counter.c[0]++,
-           float(openCL->counter.c[1] / openCL->counter.c[0]),
-           float(openCL->counter.c[2] / openCL->counter.c[0]));
-    
-#ifndef INTEROP
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, openCL->textid);
-	glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA, openCL->width, openCL->height, 0, GL_RGB, GL_UNSIGNED_BYTE, openCL->rgb);
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, 0);
+           renderer->counter.c[0]++,
+           float(renderer->counter.c[1] / renderer->counter.c[0]),
+           float(renderer->counter.c[2] / renderer->counter.c[0]));
+#if defined(WAVEFRONT) && defined(PROFILING)
+	printf("# rays per bounce:");
+	for (int i = 0; i < PATH_DEPTH && COUNTER_BOUNCE + i < 10; i ++)
+		printf(" %u", renderer->counter.c[COUNTER_BOUNCE + i]);
+	printf("\n");
+	raySortReport();
 #endif
     
+	// interop draws straight into the texture
+	if (renderer->rgb) {
+		glBindTexture(GL_TEXTURE_RECTANGLE_ARB, renderer->textid);
+		glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA, renderer->width, renderer->height, 0, GL_RGB, GL_UNSIGNED_BYTE, renderer->rgb);
+		glBindTexture(GL_TEXTURE_RECTANGLE_ARB, 0);
+	}
+    
+	// every pixel is below the noise threshold, stop rendering
+	if (renderer->converged) {
+		printf("converged after %d samples\n", renderer->samples);
+		glutIdleFunc(NULL);
+	}
+
 	glutPostRedisplay();
 }
 
@@ -106,26 +159,164 @@ void glInit(int argc, char **argv) {
 	glutReshapeFunc(reshape);
 }
 
+// headless rendering; prints the RMSE against a reference image every
+// power of two samples, so different samplers can be compared
+void batch(int samples, const char *output, const char *reference) {
+	std::vector<Vector> frame(renderer->width * renderer->height);
+	std::vector<Vector> ref;
+	
+	if (reference) {
+		int w, h;
+		if (!readPFM(reference, ref, w, h) || w != renderer->width || h != renderer->height) {
+			printf("[Batch] invalid reference image: %s\n", reference);
+			exit(1);
+		}
+		printf("# samples rmse seconds\n");
+	}
+	
+	// pixel samples actually traced, converged pixels are skipped; the OpenCL counters
+	// trail by one launch, so there the total is off by at most one launch
+	double traced = 0.;
+	double start = wallclock();
+	int next = 1;
+	while (renderer->samples < samples && !renderer->converged) {
+		renderer->executeKernel();
+		traced += (double)renderer->counter.c[COUNTER_ACTIVE] * renderer->launchSamples;
+		
+		if (reference && renderer->samples >= next) {
+			renderer->readFrame(&frame[0]);
+			printf("%d %f %f\n", renderer->samples, rmse(&frame[0], &ref[0], frame.size()), wallclock() - start);
+			while (next <= renderer->samples)
+				next <<= 1;
+		}
+	}
+	double seconds = wallclock() - start;
+	printf("[Batch] %d samples in %.2fs (%.2f Msamples/s traced)\n", renderer->samples, seconds,
+		   1e-6 * traced / seconds);
+#if defined(WAVEFRONT) && defined(PROFILING)
+	raySortReport();
+#endif
+	
+	if (output) {
+		renderer->readFrame(&frame[0]);
+		if (!writePFM(output, &frame[0], renderer->width, renderer->height)) {
+			printf("[Batch] error writing %s\n", output);
+			exit(1);
+		}
+	}
+}
+
+// the backend picked on the command line, CPU_ONLY builds only have the CPU threads
+Renderer *createRenderer(bool cpu, bool multi, bool hybrid) {
+#ifdef CPU_ONLY
+	return new CPU();
+#else
+	if (cpu)
+		return new CPU();
+	if (multi)
+		return new MultiDevice();
+	if (hybrid)
+		return new Hybrid();
+	return new OpenCL();
+#endif
+}
+
 int main(int argc, char **argv)
 {
+	const char *scene_file = NULL;
+	const char *output = NULL;
+	const char *reference = NULL;
+	int samples = 0;
+	int grid = 10;
+	int launchSamples = SAMPLES_PER_LAUNCH;
+	bool cpu = false;
+	bool traversal = false;
+	bool tune = false;
+	bool multi = false;
+	bool hybrid = false;
+	
+	for (int i = 1; i < argc; i ++) {
+		if (!strcmp(argv[i], "-cpu")) cpu = true;
+		else if (!strcmp(argv[i], "-bench")) traversal = true;
+		else if (!strcmp(argv[i], "-tune")) tune = true;
+		else if (!strcmp(argv[i], "-multi")) multi = true;
+		else if (!strcmp(argv[i], "-hybrid")) hybrid = true;
+		else if (i == argc - 1) break;
+		else if (!strcmp(argv[i], "-s")) scene_file = argv[++i];
+		else if (!strcmp(argv[i], "-n")) grid = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-b")) samples = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-l")) launchSamples = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-o")) output = argv[++i];
+		else if (!strcmp(argv[i], "-r")) reference = argv[++i];
+	}
+	
+	if (launchSamples < 1) {
+		printf("-l needs at least 1 sample per launch\n");
+		printf("usage: %s [-cpu | -multi | -hybrid] [-bench] [-tune] [-s scene.json | -n grid] [-l samples] [-b samples [-o out.pfm] [-r reference.pfm]]\n", argv[0]);
+		exit(1);
+	}
+	
 	Scene *scene = new Scene();
-    //scene->loadJson("cornell.json");
-	scene->testScene();
+	if (scene_file)
+		scene->loadJson(scene_file);
+	else
+		scene->testScene(grid);
 	scene->buildBVH();
 	
+	if (traversal) {
+		bench(scene, 1024 / DOWNSCALE, 768 / DOWNSCALE);
+		return 0;
+	}
+	
+	if (tune) {
+#ifdef INTEROP
+		printf("tuning needs INTEROP disabled\n");
+		exit(1);
+#endif
+#ifdef CPU_ONLY
+		printf("tuning needs OpenCL\n");
+		exit(1);
+#else
+		OpenCL *openCL = new OpenCL();
+		openCL->scene = scene;
+		openCL->launchSamples = launchSamples;
+		openCL->autotune();
+		delete openCL;
+		return 0;
+#endif
+	}
+	
+	if (samples) {
+#if defined(INTEROP) && !defined(CPU_ONLY)
+		if (!cpu) {
+			printf("batch mode needs INTEROP disabled\n");
+			exit(1);
+		}
+#endif
+		renderer = createRenderer(cpu, multi, hybrid);
+		renderer->scene = scene;
+		renderer->launchSamples = launchSamples;
+		renderer->createBuffers();
+		renderer->createKernel();
+		batch(samples, output, reference);
+		delete renderer;
+		
+		return 0;
+	}
+	
 	glInit(argc, argv);
-	openCL = new OpenCL();
-	openCL->scene = scene;
+	renderer = createRenderer(cpu, multi, hybrid);
+	renderer->scene = scene;
+	renderer->launchSamples = launchSamples;
 	
-	openCL->createTexture();
-	openCL->createBuffers();
-	openCL->createKernel();
-    //	openCL->executeKernel();
+	renderer->createTexture();
+	renderer->createBuffers();
+	renderer->createKernel();
+    //	renderer->executeKernel();
     
 	glutMainLoop();
 	
-	delete openCL;
+	delete renderer;
     
 	return 0;
 }
-
@@ -0,0 +1,244 @@
+//
+//  multidevice.cpp
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#include "multidevice.h"
+#include "opencl_debug.h"
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <stdlib.h>
+
+// every available device with a compiler, each on its own context
+MultiDevice::MultiDevice() {
+#ifdef INTEROP
+    std::cout << "[Multi] Needs INTEROP disabled, the bands are put together on the host" << std::endl;
+    exit(1);
+#endif
+    try {
+        std::vector<Platform> platforms;
+        Platform::get(&platforms);
+        for (size_t p = 0; p < platforms.size(); p ++) {
+            std::vector<Device> found;
+            platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &found);
+            for (size_t i = 0; i < found.size(); i ++) {
+                if (!found[i].getInfo<CL_DEVICE_AVAILABLE>() || !found[i].getInfo<CL_DEVICE_COMPILER_AVAILABLE>())
+                    continue;
+                std::cout << "[Multi] Device " << devices.size() << ": " << found[i].getInfo<CL_DEVICE_NAME>() << std::endl;
+                devices.push_back(new OpenCL(&found[i]));
+            }
+        }
+    } catch (Error err) {
+        errorDump(err);
+        exit(1);
+    }
+    
+    if (devices.empty()) {
+        std::cout << "[Multi] No OpenCL device" << std::endl;
+        exit(1);
+    }
+#if defined(PERSISTENT) || defined(WAVEFRONT)
+    // these kernels walk the whole image
+    std::cout << "[Multi] PERSISTENT and WAVEFRONT render the whole image, using device 0 only" << std::endl;
+    for (size_t i = 1; i < devices.size(); i ++)
+        delete devices[i];
+    devices.resize(1);
+#endif
+}
+
+MultiDevice::~MultiDevice() {
+    for (size_t i = 0; i < devices.size(); i ++)
+        delete devices[i];
+}
+
+void MultiDevice::createBuffers() {
+    // the devices share the scene, so they agree on the BVH leaf size
+    for (size_t i = 0; i < devices.size(); i ++) {
+        OpenCL *d = devices[i];
+        d->width = width;
+        d->height = height;
+        d->scene = scene;
+        d->launchSamples = launchSamples;
+        d->leafSize = devices[0]->leafSize;
+        d->createBuffers();
+    }
+    image.assign(width * height, Pixel());
+    rgb = &image[0];
+    
+    // even bands to start with
+    for (size_t i = 0; i < devices.size(); i ++) {
+        devices[i]->rowStart = 0;
+        devices[i]->rows = 0;
+    }
+    setBands(bands(std::vector<double>(devices.size(), 1.), std::vector<double>(height, 1.)));
+    lastSpeed.assign(devices.size(), 0.);
+    
+    samples = 0;
+    converged = false;
+}
+
+void MultiDevice::createKernel() {
+    for (size_t i = 0; i < devices.size(); i ++)
+        devices[i]->createKernel();
+}
+
+// all the devices run at once, then their bands make up the image
+void MultiDevice::executeKernel() {
+    for (size_t i = 0; i < devices.size(); i ++)
+        devices[i]->executeKernel();
+    
+    memset(&counter, 0, sizeof(counter_t));
+    converged = true;
+    for (size_t i = 0; i < devices.size(); i ++) {
+        OpenCL *d = devices[i];
+        d->finishLaunch();
+        memcpy(&image[d->rowStart * width], d->rgb + d->rowStart * width, d->rows * width * sizeof(Pixel));
+        for (int c = 0; c < 10; c ++)
+            counter.c[c] += d->counter.c[c];
+        converged = converged && d->converged;
+    }
+    samples += launchSamples;
+    
+    rebalance();
+}
+
+// each device gets a share of the active pixels in proportion to the active pixels per
+// nanosecond it managed last launch. A device whose band converged keeps its last speed
+// (the mean of the others before it had one), so it takes rows over from the bands that
+// still have work
+void MultiDevice::rebalance() {
+    const int n = devices.size();
+    if (n < 2)
+        return;
+    
+    std::vector<double> speed(n);
+    double measured = 0.;
+    int count = 0;
+    for (int i = 0; i < n; i ++) {
+        const cl_uint active = devices[i]->counter.c[COUNTER_ACTIVE];
+        if (!active)
+            continue;
+        speed[i] = lastSpeed[i] = active / (double)std::max<cl_ulong>(devices[i]->bandTime, 1);
+        measured += speed[i];
+        count ++;
+    }
+    if (!count)
+        return;
+    for (int i = 0; i < n; i ++)
+        if (!speed[i])
+            speed[i] = lastSpeed[i] ? lastSpeed[i] : measured / count;
+    
+    // where the active pixels are, a converged row still costs its schedule and image
+    // writes, counted as one pixel
+    std::vector<double> cost(height, 1.);
+    std::vector<cl_uchar> active(width * height);
+    try {
+        for (int i = 0; i < n; i ++) {
+            OpenCL *d = devices[i];
+            d->queue.enqueueReadBuffer(d->active_b, CL_TRUE, d->rowStart * width, d->rows * width, &active[d->rowStart * width]);
+        }
+    } catch (Error err) {
+        errorDump(err);
+        exit(1);
+    }
+    for (int y = 0; y < height; y ++)
+        for (int x = 0; x < width; x ++)
+            cost[y] += active[y * width + x];
+    
+    const std::vector<int> rows = bands(speed, cost);
+    bool move = false;
+    for (int i = 0; i < n; i ++)
+        move = move || abs(rows[i] - devices[i]->rows) >= MULTI_REBALANCE;
+    
+    if (move)
+        setBands(rows);
+}
+
+// bands whose summed row cost is in proportion to the weights, at least MULTI_MIN_ROWS
+// rows each; every band but the last is a multiple of its device's work group height when
+// the image allows it, the last one takes what is left (and launches with NullRange if
+// that does not divide)
+std::vector<int> MultiDevice::bands(const std::vector<double> &weight, const std::vector<double> &cost) {
+    const int n = devices.size();
+    double total = 0.;
+    for (int i = 0; i < n; i ++)
+        total += weight[i];
+    std::vector<double> prefix(height + 1, 0.);
+    for (int y = 0; y < height; y ++)
+        prefix[y + 1] = prefix[y] + cost[y];
+    
+    std::vector<int> rows(n);
+    int start = 0, left = height;
+    double share = 0.;
+    for (int i = 0; i < n - 1; i ++) {
+        // the row boundary nearest to where the cost reaches this device's share
+        share += weight[i];
+        const double target = prefix[height] * share / total;
+        int end = std::lower_bound(prefix.begin(), prefix.end(), target) - prefix.begin();
+        if (end > 0 && target - prefix[end - 1] < prefix[end] - target)
+            end --;
+        
+        const int align = devices[i]->rowAlign();
+        const int rest = (n - 1 - i) * MULTI_MIN_ROWS;
+        const int want = std::max(end - start, MULTI_MIN_ROWS);
+        const int least = (MULTI_MIN_ROWS + align - 1) / align * align;
+        const int most = (left - rest) / align * align;
+        if (least <= most)
+            rows[i] = std::min(std::max((want + align / 2) / align * align, least), most);
+        else
+            rows[i] = std::min(want, left - rest);
+        start += rows[i];
+        left -= rows[i];
+    }
+    rows[n - 1] = left;
+    return rows;
+}
+
+// consecutive bands in device order; rows moving to another device take their
+// samples with them
+void MultiDevice::setBands(const std::vector<int> &rows) {
+    std::vector<int> before(height, -1), after(height);
+    for (size_t i = 0, y = 0; i < devices.size(); i ++) {
+        for (int k = 0; k < devices[i]->rows; k ++)
+            before[devices[i]->rowStart + k] = i;
+        for (int k = 0; k < rows[i]; k ++)
+            after[y++] = i;
+    }
+    
+    for (int y = 0; y < height; ) {
+        int y1 = y + 1;
+        while (y1 < height && before[y1] == before[y] && after[y1] == after[y])
+            y1 ++;
+        if (before[y] >= 0 && before[y] != after[y])
+            devices[before[y]]->copyRows(devices[after[y]], y, y1);
+        y = y1;
+    }
+    
+    std::cout << "[Multi] Rows:";
+    for (size_t i = 0, y = 0; i < devices.size(); y += rows[i], i ++) {
+        devices[i]->rowStart = y;
+        devices[i]->rows = rows[i];
+        std::cout << " " << rows[i];
+    }
+    std::cout << std::endl;
+}
+
+void MultiDevice::readFrame(Vector *frame) {
+    std::vector<Vector> full(width * height);
+    for (size_t i = 0; i < devices.size(); i ++) {
+        OpenCL *d = devices[i];
+        d->readFrame(&full[0]);
+        std::copy(full.begin() + d->rowStart * width, full.begin() + (d->rowStart + d->rows) * width, frame + d->rowStart * width);
+    }
+}
+
+void MultiDevice::updateCamera() {
+    for (size_t i = 0; i < devices.size(); i ++)
+        devices[i]->updateCamera();
+    samples = 0;
+    converged = false;
+}
@@ -0,0 +1,36 @@
+//
+//  multidevice.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef __Oculus__multidevice__
+#define __Oculus__multidevice__
+
+#include "defs.h"
+#include "opencl.h"
+#include <vector>
+
+// every usable OpenCL device of every platform renders a band of rows of the same
+// image (-multi); the bands follow the measured speed of each device, and rows
+// changing hands take their samples along
+struct MultiDevice : public Renderer {
+	std::vector<OpenCL *> devices;
+	std::vector<Pixel> image;       // the bands of the devices put together
+	std::vector<double> lastSpeed;  // active pixels per nanosecond of each device, last launch it had any
+	
+	MultiDevice();
+	~MultiDevice();
+	void createKernel();
+	void createBuffers();
+	void executeKernel();
+	void readFrame(Vector *frame);
+	void updateCamera();
+	std::vector<int> bands(const std::vector<double> &weight, const std::vector<double> &cost);
+	void setBands(const std::vector<int> &rows);
+	void rebalance();
+};
+
+#endif /* defined(__Oculus__multidevice__) */
@@ -12,12 +12,36 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <sstream>
+#include <algorithm>
+#include <set>
+#include <stdio.h>
+#include <cfloat>
+#include <sys/stat.h>
 
+#ifdef __APPLE__
 #include <OpenGL/gl.h>
 #include <OpenGL/glext.h>
+#else
+#include <GL/gl.h>
+#include <GL/glext.h>
+#endif
 
-OpenCL::OpenCL() {
+// the first device of MAIN_DEVICE type on the first platform, or the given device on
+// its own context (MultiDevice), its queue then times the launches
+OpenCL::OpenCL(const Device *device) {
     cl_int err = CL_SUCCESS;
+#ifndef INTEROP
+    rgbMapped[0] = rgbMapped[1] = NULL;
+#endif
+    program = NULL;
+    initKernel = runKernel = scheduleKernel = resolveKernel = NULL;
+    generateKernel = extendKernel = connectKernel = occlusionKernel = NULL;
+    for (int m = 0; m < NUM_MATERIALS; m++)
+        shadeKernel[m] = NULL;
+    sortCountKernel = sortScanKernel = sortScatterKernel = NULL;
+    compactScanKernel = compactGroupsKernel = compactScatterKernel = NULL;
+    rayKeysKernel = radixCountKernel = radixScanKernel = radixScatterKernel = NULL;
     try {
         Platform::get(&platforms);
         for(int i = 0; i < platforms.size(); i++) {
@@ -35,9 +59,12 @@ OpenCL::OpenCL() {
 #ifdef INTEROP
             CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE, (cl_context_properties)shareGroup,
 #endif
-            CL_CONTEXT_PLATFORM, (cl_context_properties)(platforms[0])(),
+            CL_CONTEXT_PLATFORM, (cl_context_properties)(device ? device->getInfo<CL_DEVICE_PLATFORM>() : platforms[0]()),
             0 };
-        context = Context(MAIN_DEVICE, properties);
+        if (device)
+            context = Context(std::vector<Device>(1, *device), properties);
+        else
+            context = Context(MAIN_DEVICE, properties);
         devices = context.getInfo<CL_CONTEXT_DEVICES>();
         
         std::cout << "[CL]  Number of devices: " << context.getInfo<CL_CONTEXT_NUM_DEVICES>() << std::endl;
@@ -46,33 +73,147 @@ OpenCL::OpenCL() {
             deviceDump(&d);
         }
         
-        queue = CommandQueue(context, devices[0], 0, &err);
+#ifdef PROFILING
+        queue = CommandQueue(context, devices[0], CL_QUEUE_PROFILING_ENABLE, &err);
+#else
+        queue = CommandQueue(context, devices[0], device ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
+#endif
+        transfer = CommandQueue(context, devices[0], 0, &err);
+        
+        persistentThreads = devices[0].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * PERSISTENT_LANES;
+        hostUnified = devices[0].getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU || devices[0].getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+        std::cout << "[CL]  Host memory " << (hostUnified ? "shared, scene buffers use it in place" : "separate") << std::endl;
+        loadProfile();
         
     } catch (Error err) {
         errorDump(err);
         exit(1);
     }
+}
+
+OpenCL::~OpenCL() {
+    releaseKernels();
+}
+
+// program and kernels of the last createKernel, rebuilt by every call (autotune)
+void OpenCL::releaseKernels() {
+    Kernel **kernels[] = {
+        &initKernel, &runKernel, &scheduleKernel, &resolveKernel,
+        &generateKernel, &extendKernel, &connectKernel, &occlusionKernel,
+        &sortCountKernel, &sortScanKernel, &sortScatterKernel,
+        &compactScanKernel, &compactGroupsKernel, &compactScatterKernel,
+        &rayKeysKernel, &radixCountKernel, &radixScanKernel, &radixScatterKernel };
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        delete *kernels[i];
+        *kernels[i] = NULL;
+    }
+    for (int m = 0; m < NUM_MATERIALS; m++) {
+        delete shadeKernel[m];
+        shadeKernel[m] = NULL;
+    }
+    delete program;
+    program = NULL;
+}
+
+	
+#ifdef KERNEL_CACHE
+// the file and everything it includes with quotes, each once
+static void kernelSources(const std::string &filename, std::string &sources, std::set<std::string> &seen) {
+    if (!seen.insert(filename).second)
+        return;
     
-    width = 1024;
-    height = 768;
-    width /= DOWNSCALE;
-    height /= DOWNSCALE;
+    std::ifstream file(filename.c_str());
+    std::string line;
+    while (std::getline(file, line)) {
+        sources += line + "\n";
+        size_t start = line.find("#include \"");
+        if (start == std::string::npos)
+            continue;
+        start += 10;
+        size_t end = line.find('"', start);
+        if (end != std::string::npos)
+            kernelSources(line.substr(start, end - start), sources, seen);
+    }
 }
 
-void OpenCL::createTexture() {
-    glEnable(GL_TEXTURE_RECTANGLE_ARB);
-    glGenTextures(1, &textid);
+// 64 bit FNV-1a
+static cl_ulong hashString(const std::string &s, cl_ulong h = 14695981039346656037ULL) {
+    for (size_t i = 0; i < s.size(); i ++)
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    return h;
+}
+
+// cache file of a build: kernel sources with their includes, options, device and driver
+std::string OpenCL::binaryPath(const char *f, const std::string &options) {
+    std::string sources;
+    std::set<std::string> seen;
+    kernelSources(f, sources, seen);
     
-    glBindTexture(GL_TEXTURE_RECTANGLE_ARB, textid);
-    glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-    glBindTexture(GL_TEXTURE_RECTANGLE_ARB, 0);
+    cl_ulong h = hashString(sources);
+    h = hashString(options, h);
+    h = hashString(devices[0].getInfo<CL_DEVICE_NAME>(), h);
+    h = hashString(devices[0].getInfo<CL_DEVICE_VERSION>(), h);
+    h = hashString(devices[0].getInfo<CL_DRIVER_VERSION>(), h);
+    h = hashString(platforms[0].getInfo<CL_PLATFORM_VERSION>(), h);
+    
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)h);
+    return std::string(KERNEL_CACHE) + name;
 }
 
-	
-Program *OpenCL::compileProgram(const char *f, const char *params) {
+// program from a cached binary, NULL when missing or rejected by the driver
+Program *OpenCL::loadBinary(const std::string &path, const std::string &options) {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file.good())
+        return NULL;
+    std::string binary(std::istreambuf_iterator<char>(file), (std::istreambuf_iterator<char>()));
+    
+    double tick = wallclock();
+    Program *cached = NULL;
     try {
+        VECTOR_CLASS<Device> device(1, devices[0]);
+        Program::Binaries binaries(1, std::make_pair(binary.data(), binary.size()));
+        cached = new Program(context, device, binaries);
+        cached->build(device, options.c_str());
+    } catch (Error err) {
+        std::cout << "[CL]  Discarding cached binary: " << path << std::endl;
+        delete cached;
+        return NULL;
+    }
+    program = cached;
+    std::cout << "[CL]  Loaded binary: " << path << " (" << 1000.f * (wallclock() - tick) << " ms)" << std::endl;
+    return program;
+}
+
+void OpenCL::saveBinary(const std::string &path) {
+    VECTOR_CLASS< ::size_t> sizes = program->getInfo<CL_PROGRAM_BINARY_SIZES>();
+    VECTOR_CLASS<char *> binaries = program->getInfo<CL_PROGRAM_BINARIES>();
+    
+    mkdir(KERNEL_CACHE, 0755);
+    std::ofstream file(path.c_str(), std::ios::binary);
+    if (file.good() && sizes[0])
+        file.write(binaries[0], sizes[0]);
+    if (!file.good())
+        std::cout << "[CL]  Could not cache the binary in " << path << std::endl;
+    
+    for (size_t i = 0; i < binaries.size(); i ++)
+        delete[] binaries[i];
+}
+#endif
+
+// an optional build returns NULL when it fails instead of exiting
+Program *OpenCL::compileProgram(const char *f, const char *params, bool optional) {
+    try {
+        std::string kparams("");//-cl-strict-aliasing -cl-unsafe-math-optimizations -cl-finite-math-only ");
+        if (params)
+            kparams += std::string(params);
+        
+#ifdef KERNEL_CACHE
+        std::string path = binaryPath(f, kparams);
+        if (loadBinary(path, kparams))
+            return program;
+#endif
+        
         std::string filename(f);
         std::ifstream sourceFile(filename.c_str());
         if (!sourceFile.good())
@@ -86,17 +227,22 @@ Program *OpenCL::compileProgram(const char *f, const char *params) {
         double tick = wallclock();
         std::cout << "[CL]  Compiling: " << filename << "(" << sourceCode.length() << " bytes)" << std::endl;
         try {
-            std::string kparams("");//-cl-strict-aliasing -cl-unsafe-math-optimizations -cl-finite-math-only ");
-            if (params)
-                kparams += std::string(params);
-            
             program->build(kparams.c_str());
         } catch (Error err) {
             programBuildDump(program, &devices[0]);
+            if (optional) {
+                delete program;
+                program = NULL;
+                return NULL;
+            }
             throw err;
         }
         programBuildDump(program, &devices[0]);
         std::cout << "[CL]  Compile time: " << f << " ("<< 1000.f * (wallclock() - tick) << " ms)" << std::endl;
+        
+#ifdef KERNEL_CACHE
+        saveBinary(path);
+#endif
     } catch (Error err) {
         errorDump(err);
         exit(1);
@@ -105,12 +251,264 @@ Program *OpenCL::compileProgram(const char *f, const char *params) {
     return program;
 }
 
+// defines specialising the kernel to the scene: the primitive and material types
+// in use, the emitters when there are few of them, and no BVH for tiny scenes
+std::string OpenCL::sceneDefines() {
+    std::ostringstream defines;
+    defines << "-D FEATURES=" << scene->features();
+    
+    std::vector<size_t> lights;
+    for (size_t i = 0; i < scene->primitive_vector.size(); i ++)
+        if (scene->primitive_vector[i].m.e != 0.f)
+            lights.push_back(i);
+    if (lights.size() <= SCENE_MAX_LIGHTS) {
+        defines << " -D NUM_LIGHTS=" << lights.size() << " -D SCENE_LIGHTS=";
+        for (size_t i = 0; i < lights.size(); i ++)
+            defines << (i ? "," : "") << lights[i];
+        if (lights.empty())
+            defines << "0";
+    }
+    
+    if (scene->primitive_vector.size() < BVH_MIN_PRIMITIVES)
+        defines << " -D SCENE_NO_BVH";
+    
+#ifdef PLACE_BUFFERS
+    defines << placeBuffers();
+#endif
+    
+    return defines.str();
+}
+
+// scene buffers moved to __constant while they fit the device's constant memory: the
+// camera, read alike by every work item, then the primitives, the lights are read alike
+// as well, then the BVH
+std::string OpenCL::placeBuffers() {
+    const cl_ulong constant = devices[0].getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>();
+    const cl_uint constantArgs = devices[0].getInfo<CL_DEVICE_MAX_CONSTANT_ARGS>();
+    const cl_ulong local = devices[0].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    
+    const char *names[] = {"CAMERA_SPACE", "PRIM_SPACE", "BVH_SPACE"};
+    const cl_ulong sizes[] = {
+        sizeof(Camera),
+        sizeof(Primitive) * scene->primitive_vector.size(),
+        sizeof(BVHNode) * scene->bvhTree->bvh_vec.size()
+    };
+    
+    std::ostringstream defines;
+    cl_ulong used = CONSTANT_RESERVE;
+    cl_uint args = 0;
+    std::cout << "[CL]  Constant memory " << constant / 1024 << " KB, local memory " << local / 1024 << " KB" << std::endl;
+    for (int i = 0; i < 3; i ++) {
+        const bool fits = used + sizes[i] <= constant && args < constantArgs;
+        if (fits) {
+            defines << " -D " << names[i] << "=__constant";
+            used += sizes[i];
+            args ++;
+        }
+        std::cout << "[CL]  " << names[i] << ": " << sizes[i] << " bytes, " << (fits ? "__constant" : "__global") << std::endl;
+    }
+    
+    return defines.str();
+}
+
+// build options and kernel variant of the device profile; the treelet is cut down to
+// the device's local memory
+std::string OpenCL::tunedDefines() {
+    const cl_ulong local = devices[0].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    const int nodes = std::min<cl_ulong>(treelet, local / sizeof(BVHNode));
+    
+    std::ostringstream defines;
+    defines << tunedOptions << " -D BVH_TREELET=" << nodes;
+    return defines.str();
+}
+
 void OpenCL::createKernel() {
-    program = compileProgram("raytracer.cl");
+    releaseKernels();
+    std::string tuned = tunedDefines();
+#ifdef SPECIALISE_KERNEL
+    std::string defines = tuned + " " + sceneDefines();
+    std::cout << "[CL]  Scene defines: " << defines << std::endl;
+    if (!compileProgram("raytracer.cl", defines.c_str(), true)) {
+        std::cout << "[CL]  Specialised build failed, using the generic kernel" << std::endl;
+        compileProgram("raytracer.cl", tuned.c_str());
+    }
+#else
+    program = compileProgram("raytracer.cl", tuned.c_str());
+#endif
     
     try {
+#ifdef PERSISTENT
+        runKernel = new Kernel(*program, "raytracer_persistent");
+#else
         runKernel = new Kernel(*program, "raytracer");
+#endif
         kernelDump(runKernel);
+        scheduleKernel = new Kernel(*program, "adaptive_schedule");
+        kernelDump(scheduleKernel);
+        resolveKernel = new Kernel(*program, "film_resolve");
+        kernelDump(resolveKernel);
+        
+        // buffers don't change between frames, set them once
+        int argc = 0;
+        scheduleKernel->setArg(argc++, counter_b);
+        scheduleKernel->setArg(argc++, frame_b);
+        scheduleKernel->setArg(argc++, var_b);
+        scheduleKernel->setArg(argc++, spp_b);
+        scheduleKernel->setArg(argc++, active_b);
+        
+        argc = 0;
+        resolveKernel->setArg(argc++, accum_b);
+        resolveKernel->setArg(argc++, frame_b);
+        resolveKernel->setArg(argc++, var_b);
+        resolveKernel->setArg(argc++, spp_b);
+#ifdef INTEROP
+        resolveKernel->setArg(argc++, image_b);
+#else
+        rgbKernel = resolveKernel;
+        rgbArg = argc;
+        resolveKernel->setArg(argc++, rgb_b[0]);
+#endif
+        
+        argc = 0;
+        runKernel->setArg(argc++, counter_b);
+        runKernel->setArg(argc++, prim_b);
+        runKernel->setArg(argc++, (cl_int)scene->primitive_vector.size());
+        runKernel->setArg(argc++, camera_b);
+        runKernel->setArg(argc++, scene->seed);
+#ifdef PERSISTENT
+        runKernel->setArg(argc++, accum_b);
+        runKernel->setArg(argc++, spp_b);
+        runKernel->setArg(argc++, active_b);
+        runKernel->setArg(argc++, width);
+        runKernel->setArg(argc++, height);
+#else
+        runKernel->setArg(argc++, frame_b);
+        runKernel->setArg(argc++, var_b);
+        runKernel->setArg(argc++, spp_b);
+        runKernel->setArg(argc++, active_b);
+#ifdef INTEROP
+        runKernel->setArg(argc++, image_b);
+#else
+        rgbKernel = runKernel;
+        rgbArg = argc;
+        runKernel->setArg(argc++, rgb_b[0]);
+#endif
+#endif
+        runKernel->setArg(argc++, launchSamples);
+        runKernel->setArg(argc++, bvh_b);
+#ifndef PERSISTENT
+        runKernel->setArg(argc++, height);
+#endif
+        
+#ifdef WAVEFRONT
+        generateKernel = new Kernel(*program, "wf_generate");
+        extendKernel = new Kernel(*program, "wf_extend");
+        connectKernel = new Kernel(*program, "wf_connect");
+        occlusionKernel = new Kernel(*program, "wf_occlusion");
+        shadeKernel[Diffuse] = new Kernel(*program, "wf_shade_diffuse");
+        shadeKernel[Specular] = new Kernel(*program, "wf_shade_specular");
+        shadeKernel[Dielectric] = new Kernel(*program, "wf_shade_dielectric");
+        shadeKernel[Metal] = new Kernel(*program, "wf_shade_metal");
+        sortCountKernel = new Kernel(*program, "wf_sort_count");
+        sortScanKernel = new Kernel(*program, "wf_sort_scan");
+        sortScatterKernel = new Kernel(*program, "wf_sort_scatter");
+        compactScanKernel = new Kernel(*program, "wf_compact_scan");
+        compactGroupsKernel = new Kernel(*program, "wf_compact_groups");
+        compactScatterKernel = new Kernel(*program, "wf_compact_scatter");
+        rayKeysKernel = new Kernel(*program, "wf_ray_keys");
+        radixCountKernel = new Kernel(*program, "wf_radix_count");
+        radixScanKernel = new Kernel(*program, "wf_radix_scan");
+        radixScatterKernel = new Kernel(*program, "wf_radix_scatter");
+        
+        const cl_uint numpaths = width * height;
+        const cl_uint numgroups = (numpaths + WAVEFRONT_GROUP - 1) / WAVEFRONT_GROUP;
+        
+        argc = 0;
+        generateKernel->setArg(argc++, camera_b);
+        generateKernel->setArg(argc++, scene->seed);
+        generateKernel->setArg(argc++, spp_b);
+        generateKernel->setArg(argc++, active_b);
+        generateKernel->setArg(argc++, path_b);
+        generateKernel->setArg(argc++, ray_b);
+        generateKernel->setArg(argc++, live_b[0]);
+        
+        argc = 0;
+        extendKernel->setArg(argc++, counter_b);
+        extendKernel->setArg(argc++, prim_b);
+        extendKernel->setArg(argc++, (cl_int)scene->primitive_vector.size());
+        extendKernel->setArg(argc++, bvh_b);
+        extendKernel->setArg(argc++, path_b);
+        extendKernel->setArg(argc++, ray_b);
+        extendKernel->setArg(argc++, hit_b);
+        extendKernel->setArg(argc++, key_b);
+        extendKernel->setArg(argc++, accum_b);
+        
+        // the live count and list change every bounce, see executeWavefront
+        argc = 0;
+        sortCountKernel->setArg(argc++, key_b);
+        sortCountKernel->setArg(argc++, numpaths);
+        sortCountKernel->setArg(argc++, hist_b);
+        
+        argc = 0;
+        sortScanKernel->setArg(argc++, hist_b);
+        sortScanKernel->setArg(argc++, numgroups);
+        sortScanKernel->setArg(argc++, queue_count_b);
+        
+        argc = 0;
+        sortScatterKernel->setArg(argc++, key_b);
+        sortScatterKernel->setArg(argc++, numpaths);
+        sortScatterKernel->setArg(argc++, hist_b);
+        sortScatterKernel->setArg(argc++, queue_b);
+        
+        compactScanKernel->setArg(0, path_b);
+        compactScanKernel->setArg(3, offset_b);
+        compactScanKernel->setArg(4, group_b);
+        
+        compactGroupsKernel->setArg(0, counter_b);
+        compactGroupsKernel->setArg(1, group_b);
+        compactGroupsKernel->setArg(2, numgroups);
+        compactGroupsKernel->setArg(3, live_count_b);
+        
+        compactScatterKernel->setArg(0, path_b);
+        compactScatterKernel->setArg(3, offset_b);
+        compactScatterKernel->setArg(4, group_b);
+        
+        rayKeysKernel->setArg(0, bvh_b);
+        rayKeysKernel->setArg(1, ray_b);
+        rayKeysKernel->setArg(4, ray_key_b[0]);
+        radixCountKernel->setArg(3, hist_b);
+        radixScanKernel->setArg(0, hist_b);
+        radixScatterKernel->setArg(4, hist_b);
+        
+        argc = 0;
+        connectKernel->setArg(argc++, prim_b);
+        connectKernel->setArg(argc++, (cl_int)scene->primitive_vector.size());
+        connectKernel->setArg(argc++, path_b);
+        connectKernel->setArg(argc++, ray_b);
+        connectKernel->setArg(argc++, hit_b);
+        connectKernel->setArg(argc++, queue_b);
+        connectKernel->setArg(8, shadow_b);
+        connectKernel->setArg(9, shadow_count_b);
+        
+        argc = 0;
+        occlusionKernel->setArg(argc++, counter_b);
+        occlusionKernel->setArg(argc++, prim_b);
+        occlusionKernel->setArg(argc++, (cl_int)scene->primitive_vector.size());
+        occlusionKernel->setArg(argc++, bvh_b);
+        occlusionKernel->setArg(argc++, shadow_b);
+        occlusionKernel->setArg(argc++, shadow_count_b);
+        occlusionKernel->setArg(argc++, path_b);
+        
+        for (int m = 0; m < NUM_MATERIALS; m ++) {
+            argc = 0;
+            shadeKernel[m]->setArg(argc++, prim_b);
+            shadeKernel[m]->setArg(argc++, path_b);
+            shadeKernel[m]->setArg(argc++, ray_b);
+            shadeKernel[m]->setArg(argc++, hit_b);
+            shadeKernel[m]->setArg(argc++, accum_b);
+            shadeKernel[m]->setArg(argc++, queue_b);
+        }
+#endif
     } catch (Error err) {
         errorDump(err);
         exit(1);
@@ -119,22 +517,76 @@ void OpenCL::createKernel() {
 
 void OpenCL::createBuffers() {
     try {
-        prim_b = Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Primitive) * scene->primitive_vector.size(), &scene->primitive_vector[0]);
+        if (scene->bvhTree->leafSize != leafSize)
+            scene->bvhTree->Serialize(leafSize);
+        
+        // devices sharing host memory read the scene where it is instead of a copy
+        const cl_mem_flags scene_flags = CL_MEM_READ_ONLY | (hostUnified ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR);
+        prim_b = Buffer(context, scene_flags, sizeof(Primitive) * scene->primitive_vector.size(), &scene->primitive_vector[0]);
         camera_b = Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Camera), &scene->camera);
         frame_b = Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(Vector));
+        var_b = Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(cl_float));
+        active_b = Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(cl_uchar));
+        
+        // per pixel sample count, every pixel starts empty
+        std::vector<cl_uint> spp(width * height, 0);
+        spp_b = Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, width * height * sizeof(cl_uint), &spp[0]);
+        std::vector<Accum> accum(width * height, (Accum){0.f, 0.f, 0.f, 0.f, 0});
+        accum_b = Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, width * height * sizeof(Accum), &accum[0]);
         ray_b = Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(Ray));
-        bvh_b = Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(BVHNode) * scene->bvhTree->bvh_vec.size(), &scene->bvhTree->bvh_vec[0]);
+#ifdef WAVEFRONT
+        path_b = Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(PathState));
+        hit_b = Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(Hit));
+        key_b = Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(cl_uint));
+        hist_b = Buffer(context, CL_MEM_READ_WRITE, std::max(NUM_MATERIALS, 1 << RADIX_BITS) * (width * height / WAVEFRONT_GROUP + 1) * sizeof(cl_uint));
+        queue_b = Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(cl_uint));
+        queue_count_b = Buffer(context, CL_MEM_READ_WRITE, sizeof(queue_count));
+        
+        const size_t numgroups = width * height / WAVEFRONT_GROUP + 1;
+        live_b[0] = Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(cl_uint));
+        live_b[1] = Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(cl_uint));
+        offset_b = Buffer(context, CL_MEM_READ_WRITE, numgroups * WAVEFRONT_GROUP * sizeof(cl_uint));
+        group_b = Buffer(context, CL_MEM_READ_WRITE, numgroups * sizeof(cl_uint));
+        live_count_b = Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+        ray_key_b[0] = Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(cl_uint));
+        ray_key_b[1] = Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(cl_uint));
+        
+        // every diffuse hit may emit a shadow ray per light of a chunk
+        numLights = 0;
+        for (size_t i = 0; i < scene->primitive_vector.size(); i++)
+            numLights += (scene->primitive_vector[i].m.e != 0.f);
+        shadow_b = Buffer(context, CL_MEM_READ_WRITE, width * height * std::max(std::min(numLights, SHADOW_CHUNK), 1) * sizeof(ShadowRay));
+        shadow_count_b = Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+#endif
+        bvh_b = Buffer(context, scene_flags, sizeof(BVHNode) * scene->bvhTree->bvh_vec.size(), &scene->bvhTree->bvh_vec[0]);
         counter_b = Buffer(context, CL_MEM_READ_WRITE, sizeof(counter));
         
 #ifdef INTEROP
         image_b = ImageGL(context, CL_MEM_WRITE_ONLY, GL_TEXTURE_RECTANGLE_ARB, 0, textid);
         glObjects.push_back(image_b);
 #else
-        rgb = new Pixel[width * height];
-        rgb_b = Buffer(context, CL_MEM_READ_WRITE, width * height * sizeof(Vector));
+        // mapped for the window, on the host memory of CPU devices or pinned memory of
+        // the others, instead of read into a separate array
+        for (int i = 0; i < 2; i ++) {
+            if (rgbMapped[i])
+                queue.enqueueUnmapMemObject(rgb_b[i], rgbMapped[i]);
+            rgb_b[i] = Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, width * height * sizeof(Pixel));
+            rgbMapped[i] = NULL;
+        }
+        rgb = NULL;
 #endif
+        rowStart = 0;
+        rows = height;
+        bandTime = 0;
+        launch = 0;
+        for (int i = 0; i < 2; i ++)
+            computed[i] = readback[i] = mapped[i] = Event();
+        uploaded = Event();
         
         samples = 0;
+        converged = false;
+        extendTime[0] = extendTime[1] = sortTime = 0;
+        profiledPasses[0] = profiledPasses[1] = 0;
         
     } catch (Error err) {
         errorDump(err);
@@ -144,42 +596,514 @@ void OpenCL::createBuffers() {
 
 void OpenCL::executeKernel() {
     try {
-        int argc = 0;
-        
-        runKernel->setArg(argc++, counter_b);
-        runKernel->setArg(argc++, prim_b);
-        runKernel->setArg(argc++, scene->primitive_vector.size());
-        runKernel->setArg(argc++, camera_b);
-        runKernel->setArg(argc++, (random_state_t){{(cl_uint)random(), (cl_uint)random()}});
-        runKernel->setArg(argc++, frame_b);
-#ifdef INTEROP
-        runKernel->setArg(argc++, image_b);
-#else
-        runKernel->setArg(argc++, rgb_b);
+        samples += launchSamples;
+        const int slot = launch++ & 1;
+#ifndef INTEROP
+        // the window is done with the image of two launches ago, this launch reuses its buffer
+        if (rgbMapped[slot]) {
+            queue.enqueueUnmapMemObject(rgb_b[slot], rgbMapped[slot]);
+            rgbMapped[slot] = NULL;
+        }
+        rgbKernel->setArg(rgbArg, rgb_b[slot]);
 #endif
-        runKernel->setArg(argc++, samples++);
-        runKernel->setArg(argc++, bvh_b);
-        runKernel->setArg(argc++, scene->bvhTree->bvh_vec.size());
         
-        memset(&counter, 0, sizeof(counter_t));
-        queue.enqueueWriteBuffer(counter_b, CL_TRUE, 0, sizeof(counter), &counter);
+        // nothing here blocks. The counter is reset once the transfer queue read it
+        // back for the previous launch and scene edits are uploaded, the readback of
+        // this launch waits for its last kernel
+        std::vector<Event> after;
+        if (readback[slot ^ 1]())
+            after.push_back(readback[slot ^ 1]);
+        if (uploaded()) {
+            after.push_back(uploaded);
+            uploaded = Event();
+        }
+        queue.enqueueFillBuffer(counter_b, (cl_uint)0, 0, sizeof(counter_t), &after);
 
 #ifdef INTEROP
         queue.enqueueAcquireGLObjects(&glObjects);
 #endif
-        Event event;
         NDRange global(width, height);
-        queue.enqueueNDRangeKernel(*runKernel, NullRange, global, NullRange, NULL, &event);
-        event.wait();
+#if defined(WAVEFRONT) || defined(PERSISTENT)
+        queue.enqueueNDRangeKernel(*scheduleKernel, NullRange, global, NullRange);
+#else
+        // the band of rows of this device, all of them unless MultiDevice split the image
+        NDRange offset(0, rowStart);
+        NDRange band(width, rows);
+        queue.enqueueNDRangeKernel(*scheduleKernel, offset, band, NullRange);
+#endif
+#if defined(WAVEFRONT)
+        executeWavefront();
+        queue.enqueueNDRangeKernel(*resolveKernel, NullRange, global, NullRange, NULL, &computed[slot]);
+#elif defined(PERSISTENT)
+        queue.enqueueNDRangeKernel(*runKernel, NullRange, NDRange(persistentThreads), NullRange);
+        queue.enqueueNDRangeKernel(*resolveKernel, NullRange, global, NullRange, NULL, &computed[slot]);
+#else
+        // the tuned work group shape, unless the band is not a multiple of it
+        const bool fits = localSize.dimensions() && !(rows % localSize[1]);
+        queue.enqueueNDRangeKernel(*runKernel, offset, band, fits ? localSize : NullRange, NULL, &computed[slot]);
+#endif
+        
+        // the counters first, the next launch only waits for them
+        std::vector<Event> done(1, computed[slot]);
+        transfer.enqueueReadBuffer(counter_b, CL_FALSE, 0, sizeof(counter_t), &counters[slot], &done, &readback[slot]);
+#ifdef INTEROP
+        queue.enqueueReleaseGLObjects(&glObjects, NULL, &mapped[slot]);
+#else
+        rgbMapped[slot] = (Pixel *)transfer.enqueueMapBuffer(rgb_b[slot], CL_FALSE, CL_MAP_READ, 0, width * height * sizeof(Pixel), &done, &mapped[slot]);
+#endif
+        queue.flush();
+        transfer.flush();
         
+        // the window gets the previous launch while this one runs; GL draws the
+        // interop image right away, so that waits for this launch
 #ifdef INTEROP
-        queue.enqueueReleaseGLObjects(&glObjects);
+        const int shown = slot;
 #else
-        queue.enqueueReadBuffer(rgb_b, CL_TRUE, 0, width * height * sizeof(Pixel), rgb);
-#endif			
+        const int shown = mapped[slot ^ 1]() ? slot ^ 1 : slot;
+#endif
+        readback[shown].wait();
+        mapped[shown].wait();
+#ifndef INTEROP
+        rgb = rgbMapped[shown];
+#endif
+        counter = counters[shown];
+        converged = (counter.c[COUNTER_ACTIVE] == 0);
+
+    }
+    catch (Error err) {
+        errorDump(err);
+        exit(1);
+    }
+}
+
+// waits for the launch just queued rather than the previous one, when the caller needs
+// the image of this launch; with a timed queue, keeps how long its kernel ran
+void OpenCL::finishLaunch() {
+    try {
+        const int slot = (launch - 1) & 1;
+        readback[slot].wait();
+        mapped[slot].wait();
+#ifndef INTEROP
+        rgb = rgbMapped[slot];
+#endif
+        counter = counters[slot];
+        converged = (counter.c[COUNTER_ACTIVE] == 0);
+        
+        if (queue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE)
+            bandTime = computed[slot].getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+                computed[slot].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    }
+    catch (Error err) {
+        errorDump(err);
+        exit(1);
+    }
+}
+
+// film state of rows [y0, y1) handed to another device rendering the same scene; the
+// 8 bit image is not copied, the next launch of the device writes every row of its band
+// (converged pixels from the frame copied here) before MultiDevice reads it
+void OpenCL::copyRows(OpenCL *to, int y0, int y1) {
+    try {
+        const size_t first = y0 * width, count = (y1 - y0) * width;
+        std::vector<Vector> frame(count);
+        std::vector<cl_float> variance(count);
+        std::vector<cl_uint> spp(count);
+        
+        queue.finish();
+        transfer.finish();
+        queue.enqueueReadBuffer(frame_b, CL_TRUE, first * sizeof(Vector), count * sizeof(Vector), &frame[0]);
+        queue.enqueueReadBuffer(var_b, CL_TRUE, first * sizeof(cl_float), count * sizeof(cl_float), &variance[0]);
+        queue.enqueueReadBuffer(spp_b, CL_TRUE, first * sizeof(cl_uint), count * sizeof(cl_uint), &spp[0]);
+        
+        to->queue.finish();
+        to->transfer.finish();
+        to->queue.enqueueWriteBuffer(to->frame_b, CL_TRUE, first * sizeof(Vector), count * sizeof(Vector), &frame[0]);
+        to->queue.enqueueWriteBuffer(to->var_b, CL_TRUE, first * sizeof(cl_float), count * sizeof(cl_float), &variance[0]);
+        to->queue.enqueueWriteBuffer(to->spp_b, CL_TRUE, first * sizeof(cl_uint), count * sizeof(cl_uint), &spp[0]);
+    }
+    catch (Error err) {
+        errorDump(err);
+        exit(1);
+    }
+}
+
+#ifndef INTEROP
+// rows of the tuned work group shape, bands that are a multiple of it keep using it
+int OpenCL::rowAlign() {
+    return localSize.dimensions() ? (int)localSize[1] : 1;
+}
+
+// Hybrid: the adaptive schedule over the whole image, the CPU side gets which pixels
+// are active and their sample counts
+void OpenCL::scheduleFrame(cl_uchar *active, cl_uint *spp) {
+    try {
+        transfer.finish();
+        queue.enqueueFillBuffer(counter_b, (cl_uint)0, 0, sizeof(counter_t));
+        queue.enqueueNDRangeKernel(*scheduleKernel, NullRange, NDRange(width, height), NullRange);
+        queue.enqueueReadBuffer(active_b, CL_FALSE, 0, width * height * sizeof(cl_uchar), active);
+        queue.enqueueReadBuffer(spp_b, CL_TRUE, 0, width * height * sizeof(cl_uint), spp);
+        samples += launchSamples;
+    }
+    catch (Error err) {
+        errorDump(err);
+        exit(1);
+    }
+}
+
+// Hybrid: the raytracer over rows [y0, y0 + n), the image goes to the first buffer
+void OpenCL::traceRows(int y0, int n) {
+    try {
+        const bool fits = localSize.dimensions() && !(n % localSize[1]);
+        rgbKernel->setArg(rgbArg, rgb_b[0]);
+        queue.enqueueNDRangeKernel(*runKernel, NDRange(0, y0), NDRange(width, n), fits ? localSize : NullRange);
+        queue.finish();
+    }
+    catch (Error err) {
+        errorDump(err);
+        exit(1);
+    }
+}
+
+// Hybrid: samples the CPU traced for rows [y0, y0 + n) merged into the film, then the
+// image and counters of the frame read back
+void OpenCL::resolveRows(const Accum *accum, int y0, int n, Pixel *image) {
+    try {
+        if (n) {
+            queue.enqueueWriteBuffer(accum_b, CL_FALSE, y0 * width * sizeof(Accum), n * width * sizeof(Accum), accum + y0 * width);
+            queue.enqueueNDRangeKernel(*resolveKernel, NDRange(0, y0), NDRange(width, n), NullRange);
+        }
+        queue.enqueueReadBuffer(rgb_b[0], CL_FALSE, 0, width * height * sizeof(Pixel), image);
+        queue.enqueueReadBuffer(counter_b, CL_TRUE, 0, sizeof(counter_t), &counter);
+        converged = (counter.c[COUNTER_ACTIVE] == 0);
+    }
+    catch (Error err) {
+        errorDump(err);
+        exit(1);
+    }
+}
+#endif
+
+// the camera of the scene moved: once the launches in flight are done, the transfer
+// queue uploads it and clears the film, the next launch waits for that
+void OpenCL::updateCamera() {
+    try {
+        std::vector<Event> after;
+        const int last = (launch - 1) & 1;
+        if (launch && computed[last]())
+            after.push_back(computed[last]);
+        
+        // kept until the non blocking write is done, a quick second edit waits for the first
+        if (cameraWritten())
+            cameraWritten.wait();
+        uploadCamera = scene->camera;
+        transfer.enqueueWriteBuffer(camera_b, CL_FALSE, 0, sizeof(Camera), &uploadCamera, &after, &cameraWritten);
+        transfer.enqueueFillBuffer(spp_b, (cl_uint)0, 0, width * height * sizeof(cl_uint));
+        transfer.enqueueFillBuffer(accum_b, (cl_uint)0, 0, width * height * sizeof(Accum), NULL, &uploaded);
+        transfer.flush();
+        
+        samples = 0;
+        converged = false;
+    }
+    catch (Error err) {
+        errorDump(err);
+        exit(1);
+    }
+}
+
+// the tuning profile has one line per device: name / driver, local size x and y
+// (0 for the driver's choice), BVH leaf size, treelet nodes and build options, tab
+// separated
+std::string OpenCL::deviceKey() {
+    return std::string(devices[0].getInfo<CL_DEVICE_NAME>().c_str()) + " / " +
+        std::string(devices[0].getInfo<CL_DRIVER_VERSION>().c_str());
+}
 
-        queue.enqueueReadBuffer(counter_b, CL_TRUE, 0, sizeof(counter), &counter);
+void OpenCL::loadProfile() {
+    localSize = NullRange;
+    tunedOptions = "";
+    leafSize = BVH_LEAF_SIZE;
+    treelet = BVH_TREELET;
+    
+    std::ifstream file(TUNING_PROFILE);
+    std::string line, key = deviceKey();
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string device, x, y, leaf, nodes, options;
+        if (!std::getline(fields, device, '\t') || device != key)
+            continue;
+        std::getline(fields, x, '\t');
+        std::getline(fields, y, '\t');
+        std::getline(fields, leaf, '\t');
+        std::getline(fields, nodes, '\t');
+        std::getline(fields, options);
+        
+        if (atoi(x.c_str()) && atoi(y.c_str()))
+            localSize = NDRange(atoi(x.c_str()), atoi(y.c_str()));
+        leafSize = std::max(atoi(leaf.c_str()), 1);
+        treelet = std::max(atoi(nodes.c_str()), 0);
+        tunedOptions = options;
+        if (options.find("-cl-fast-relaxed-math") != std::string::npos) {
+            std::cout << "[CL]  Ignoring -cl-fast-relaxed-math from " << TUNING_PROFILE << std::endl;
+            tunedOptions = "";
+        }
+        std::cout << "[CL]  Tuned: local " << x << "x" << y << ", leaf " << leafSize << ", treelet " << treelet
+                  << ", options \"" << tunedOptions << "\"" << std::endl;
+    }
+}
 
+// replaces the line of this device
+void OpenCL::saveProfile() {
+    std::vector<std::string> lines;
+    std::string line, key = deviceKey();
+    std::ifstream in(TUNING_PROFILE);
+    while (std::getline(in, line))
+        if (line.compare(0, key.size() + 1, key + "\t"))
+            lines.push_back(line);
+    in.close();
+    
+    std::ostringstream tuned;
+    tuned << key << "\t" << (localSize.dimensions() ? localSize[0] : 0) << "\t" << (localSize.dimensions() ? localSize[1] : 0)
+          << "\t" << leafSize << "\t" << treelet << "\t" << tunedOptions;
+    lines.push_back(tuned.str());
+    
+    std::ofstream out(TUNING_PROFILE);
+    for (size_t i = 0; i < lines.size(); i ++)
+        out << lines[i] << std::endl;
+}
+
+// every pixel back to no samples, so configurations are timed on the same work
+void OpenCL::resetFilm() {
+    std::vector<cl_uint> spp(width * height, 0);
+    std::vector<Accum> accum(width * height, (Accum){0.f, 0.f, 0.f, 0.f, 0});
+    queue.enqueueWriteBuffer(spp_b, CL_TRUE, 0, width * height * sizeof(cl_uint), &spp[0]);
+    queue.enqueueWriteBuffer(accum_b, CL_TRUE, 0, width * height * sizeof(Accum), &accum[0]);
+    samples = 0;
+    converged = false;
+}
+
+// times every combination of leaf size, build options and work group shape on
+// the loaded scene, then stores the fastest in the profile
+void OpenCL::autotune() {
+    static const int leaves[] = {1, 2, 4, 8};
+    // no -cl-fast-relaxed-math: it implies finite math only, and the slab tests need 1 / 0 = inf
+    static const char *options[] = {"", "-cl-mad-enable"};
+    static const int treelets[] = {0, 64, 256};
+    static const size_t shapes[][2] = {{0, 0}, {8, 8}, {16, 4}, {32, 1}, {16, 16}, {64, 1}};
+    const size_t maxGroup = devices[0].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    
+    double best = DBL_MAX;
+    NDRange bestLocal = NullRange;
+    std::string bestOptions;
+    int bestLeaf = BVH_LEAF_SIZE;
+    int bestTreelet = BVH_TREELET;
+    
+    for (size_t l = 0; l < sizeof(leaves) / sizeof(leaves[0]); l ++) {
+        leafSize = leaves[l];
+        createBuffers();
+        for (size_t o = 0; o < sizeof(options) / sizeof(options[0]); o ++) {
+            for (size_t t = 0; t < sizeof(treelets) / sizeof(treelets[0]); t ++) {
+                if (treelets[t] * sizeof(BVHNode) > devices[0].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>())
+                    continue;
+                tunedOptions = options[o];
+                treelet = treelets[t];
+                createKernel();
+                for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s ++) {
+                    const size_t x = shapes[s][0], y = shapes[s][1];
+                    if (x && (width % x || height % y || x * y > maxGroup))
+                        continue;
+                    localSize = x ? NDRange(x, y) : NullRange;
+                    
+                    // the first launch pays for the warm up
+                    resetFilm();
+                    executeKernel();
+                    queue.finish();
+                    transfer.finish();
+                    double tick = wallclock();
+                    for (int i = 0; i < TUNE_LAUNCHES; i ++)
+                        executeKernel();
+                    queue.finish();
+                    transfer.finish();
+                    double ms = 1000. * (wallclock() - tick) / TUNE_LAUNCHES;
+                    
+                    printf("[Tune] leaf %d, treelet %d, local %zux%zu, options \"%s\": %.2fms\n", leafSize, treelet, x, y, options[o], ms);
+                    if (ms < best) {
+                        best = ms;
+                        bestLocal = localSize;
+                        bestOptions = options[o];
+                        bestLeaf = leafSize;
+                        bestTreelet = treelet;
+                    }
+                }
+            }
+        }
+    }
+    
+    localSize = bestLocal;
+    tunedOptions = bestOptions;
+    leafSize = bestLeaf;
+    treelet = bestTreelet;
+    saveProfile();
+    printf("[Tune] best: %.2fms, saved in %s\n", best, TUNING_PROFILE);
+}
+
+// drops the terminated paths from the live list, returns how many are left
+cl_uint OpenCL::compactPaths(Buffer &live, cl_uint count, Buffer &next, int bounce) {
+    const cl_uint numgroups = (count + WAVEFRONT_GROUP - 1) / WAVEFRONT_GROUP;
+    const NDRange global(numgroups * WAVEFRONT_GROUP);
+    const NDRange local(WAVEFRONT_GROUP);
+    
+    compactScanKernel->setArg(1, live);
+    compactScanKernel->setArg(2, count);
+    queue.enqueueNDRangeKernel(*compactScanKernel, NullRange, global, local);
+    
+    compactGroupsKernel->setArg(2, numgroups);
+    compactGroupsKernel->setArg(4, bounce);
+    queue.enqueueNDRangeKernel(*compactGroupsKernel, NullRange, local, local);
+    
+    compactScatterKernel->setArg(1, live);
+    compactScatterKernel->setArg(2, count);
+    compactScatterKernel->setArg(5, next);
+    queue.enqueueNDRangeKernel(*compactScatterKernel, NullRange, global, local);
+    
+    cl_uint live_count;
+    queue.enqueueReadBuffer(live_count_b, CL_TRUE, 0, sizeof(cl_uint), &live_count);
+    return live_count;
+}
+
+#if (RAY_KEY_BITS / RADIX_BITS) % 2
+#error "sortRays expects an even number of radix passes"
+#endif
+
+// reorders the live list by ray key; the passes ping-pong between live and
+// scratch, an even number of them leaves the sorted list in live
+void OpenCL::sortRays(Buffer &live, cl_uint count, Buffer &scratch, Event *start, Event *end) {
+    const cl_uint numgroups = (count + WAVEFRONT_GROUP - 1) / WAVEFRONT_GROUP;
+    const NDRange global(numgroups * WAVEFRONT_GROUP);
+    const NDRange local(WAVEFRONT_GROUP);
+    Buffer *keys[2] = {&ray_key_b[0], &ray_key_b[1]};
+    Buffer *values[2] = {&live, &scratch};
+    
+    rayKeysKernel->setArg(2, live);
+    rayKeysKernel->setArg(3, count);
+    queue.enqueueNDRangeKernel(*rayKeysKernel, NullRange, NDRange(count), NullRange, NULL, start);
+    
+    int p = 0;
+    for (cl_uint shift = 0; shift < RAY_KEY_BITS; shift += RADIX_BITS, p ^= 1) {
+        radixCountKernel->setArg(0, *keys[p]);
+        radixCountKernel->setArg(1, count);
+        radixCountKernel->setArg(2, shift);
+        queue.enqueueNDRangeKernel(*radixCountKernel, NullRange, global, local);
+        
+        radixScanKernel->setArg(1, numgroups);
+        queue.enqueueNDRangeKernel(*radixScanKernel, NullRange, local, local);
+        
+        radixScatterKernel->setArg(0, *keys[p]);
+        radixScatterKernel->setArg(1, *values[p]);
+        radixScatterKernel->setArg(2, count);
+        radixScatterKernel->setArg(3, shift);
+        radixScatterKernel->setArg(5, *keys[p ^ 1]);
+        radixScatterKernel->setArg(6, *values[p ^ 1]);
+        queue.enqueueNDRangeKernel(*radixScatterKernel, NullRange, global, local,
+                                   NULL, shift + RADIX_BITS >= RAY_KEY_BITS ? end : NULL);
+    }
+}
+
+static cl_ulong elapsed(const Event &start, const Event &end) {
+    return end.getProfilingInfo<CL_PROFILING_COMMAND_END>() - start.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+}
+
+// one pass of every stage kernel per bounce, for each sample of the launch;
+// bounces only launch over the paths still alive
+void OpenCL::executeWavefront() {
+#ifdef PROFILING
+    // every other launch sorts, so both extend timings come from the same run
+    const int sorted = (samples / launchSamples) & 1;
+#else
+    const int sorted = scene->sortRays;
+#endif
+    for (int pass = 0; pass < launchSamples; pass ++) {
+        generateKernel->setArg(7, pass);
+        queue.enqueueNDRangeKernel(*generateKernel, NullRange, NDRange(width, height), NullRange);
+        
+        int cur = 1;
+        cl_uint count = compactPaths(live_b[0], width * height, live_b[1], 0);
+        
+        for (int bounce = 0; bounce < PATH_DEPTH && count; bounce ++) {
+            const NDRange sortGlobal((count + WAVEFRONT_GROUP - 1) / WAVEFRONT_GROUP * WAVEFRONT_GROUP);
+            const NDRange sortLocal(WAVEFRONT_GROUP);
+            
+            Event sortStart, sortEnd, extendEvent;
+            if (sorted)
+                sortRays(live_b[cur], count, live_b[cur ^ 1], &sortStart, &sortEnd);
+            
+            extendKernel->setArg(9, live_b[cur]);
+            queue.enqueueNDRangeKernel(*extendKernel, NullRange, NDRange(count), NullRange, NULL, &extendEvent);
+            
+            // sort the hits by material, each material becomes a contiguous range of queue_b
+            sortCountKernel->setArg(1, count);
+            sortScanKernel->setArg(1, (cl_uint)(sortGlobal[0] / WAVEFRONT_GROUP));
+            sortScatterKernel->setArg(1, count);
+            sortScatterKernel->setArg(4, live_b[cur]);
+            queue.enqueueNDRangeKernel(*sortCountKernel, NullRange, sortGlobal, sortLocal);
+            queue.enqueueNDRangeKernel(*sortScanKernel, NullRange, sortLocal, sortLocal);
+            queue.enqueueNDRangeKernel(*sortScatterKernel, NullRange, sortGlobal, sortLocal);
+            queue.enqueueReadBuffer(queue_count_b, CL_TRUE, 0, sizeof(queue_count), queue_count);
+#ifdef PROFILING
+            extendTime[sorted] += elapsed(extendEvent, extendEvent);
+            if (sorted)
+                sortTime += elapsed(sortStart, sortEnd);
+#endif
+            
+            cl_uint first[NUM_MATERIALS];
+            cl_uint total = 0;
+            for (int m = 0; m < NUM_MATERIALS; m ++) {
+                first[m] = total;
+                total += queue_count[m];
+            }
+            
+            // lighting has to see the ray before the diffuse bounce replaces it,
+            // the shadow rays of all diffuse hits are then traced as one batch per
+            // SHADOW_CHUNK lights (a single pass for the ambient term without lights)
+            if (queue_count[Diffuse]) {
+                static const cl_uint zero = 0;
+                connectKernel->setArg(6, first[Diffuse]);
+                connectKernel->setArg(7, queue_count[Diffuse]);
+                int light = 0;
+                do {
+                    const int chunk = std::min(numLights - light, SHADOW_CHUNK);
+                    queue.enqueueWriteBuffer(shadow_count_b, CL_FALSE, 0, sizeof(cl_uint), &zero);
+                    connectKernel->setArg(10, (cl_uint)light);
+                    connectKernel->setArg(11, (cl_uint)(light + chunk));
+                    queue.enqueueNDRangeKernel(*connectKernel, NullRange, NDRange(queue_count[Diffuse]), NullRange);
+                    if (chunk > 0)
+                        queue.enqueueNDRangeKernel(*occlusionKernel, NullRange, NDRange(queue_count[Diffuse] * chunk), NullRange);
+                    light += SHADOW_CHUNK;
+                } while (light < numLights);
+            }
+            
+            for (int m = 0; m < NUM_MATERIALS; m ++) {
+                if (!queue_count[m])
+                    continue;
+                shadeKernel[m]->setArg(6, first[m]);
+                shadeKernel[m]->setArg(7, queue_count[m]);
+                queue.enqueueNDRangeKernel(*shadeKernel[m], NullRange, NDRange(queue_count[m]), NullRange);
+            }
+            
+            // the last bounce terminates every path
+            if (bounce + 1 < PATH_DEPTH && total) {
+                count = compactPaths(live_b[cur], count, live_b[cur ^ 1], bounce + 1);
+                cur ^= 1;
+            } else {
+                count = 0;
+            }
+        }
+        profiledPasses[sorted] ++;
+    }
+}
+
+void OpenCL::readFrame(Vector *frame) {
+    try {
+        queue.enqueueReadBuffer(frame_b, CL_TRUE, 0, width * height * sizeof(Vector), frame);
     }
     catch (Error err) {
         errorDump(err);
@@ -13,43 +13,99 @@
 
 #include "defs.h"
 #include "scene.h"
+#include "renderer.h"
 #include "cl.hpp"
 #include <vector>
 
 using namespace cl;
 
-struct OpenCL {
+struct OpenCL : public Renderer {
 	std::vector<Platform> platforms;
 	std::vector<Device> devices;
 	Context context;
 	Program *program;
 	Kernel *initKernel;
 	Kernel *runKernel;
-	CommandQueue queue;
-    counter_t counter;
+	Kernel *scheduleKernel;
+	Kernel *resolveKernel;
+	Kernel *generateKernel, *extendKernel, *connectKernel, *occlusionKernel, *shadeKernel[NUM_MATERIALS];
+	Kernel *sortCountKernel, *sortScanKernel, *sortScatterKernel;
+	Kernel *compactScanKernel, *compactGroupsKernel, *compactScatterKernel;
+	Kernel *rayKeysKernel, *radixCountKernel, *radixScanKernel, *radixScatterKernel;
+	CommandQueue queue;         // kernels
+	CommandQueue transfer;      // readbacks and scene uploads, ordered against the kernels by events
+    cl_uint queue_count[NUM_MATERIALS];
     
-	int width;
-	int height;
-	int samples;
-	Scene *scene;
+	int persistentThreads;
+	int numLights;      // emissive primitives, shadow rays per diffuse hit
+	NDRange localSize;          // tuned work group shape of the raytracer kernel, NullRange lets the driver pick
+	std::string tunedOptions;   // tuned build options
+	int leafSize;               // tuned BVH leaf size
+	int treelet;                // tuned BVH nodes cached in local memory (BVH_TREELET)
 	
-	GLuint textid;
-	Buffer prim_b, camera_b, random_b, frame_b, ray_b, bvh_b, counter_b;
+	cl_ulong extendTime[2];  // PROFILING: extend nanoseconds without / with ray sorting
+	cl_ulong sortTime;       // PROFILING: ray sorting nanoseconds
+	int profiledPasses[2];
+	
+	Buffer prim_b, camera_b, frame_b, var_b, spp_b, active_b, accum_b, ray_b, bvh_b, counter_b;
+	Buffer path_b, hit_b, key_b, hist_b, queue_b, queue_count_b;
+	Buffer live_b[2], offset_b, group_b, live_count_b, ray_key_b[2];
+	Buffer shadow_b, shadow_count_b;
     
 #ifdef INTEROP
 	ImageGL image_b;
 	std::vector<Memory> glObjects;
 #else
-	Pixel *rgb;
-	Buffer rgb_b;
+	Buffer rgb_b[2];                    // 8 bit image of alternate launches, the window shows one while the other fills
+	Pixel *rgbMapped[2];                // their host mapping, NULL while the device may write them
+	Kernel *rgbKernel;                  // kernel writing the 8 bit image, and its argument
+	cl_uint rgbArg;
 #endif
+	bool hostUnified;                   // the device works on host memory, scene buffers are not copied
+	counter_t counters[2];
+	Event computed[2];                  // last kernel of the launch of each slot
+	Event readback[2];                  // counters of each slot read back
+	Event mapped[2];                    // image of each slot mapped for the window
+	Event uploaded;                     // pending scene edits, the next launch waits for them
+	Camera uploadCamera;                // host copy of the camera a non blocking write reads
+	Event cameraWritten;                // that write, uploadCamera is free once it completes
+	int launch;                         // launches since the buffers were created, picks the slot
+	int rowStart, rows;                 // band of the image rendered here, all of it unless MultiDevice split it
+	cl_ulong bandTime;                  // MultiDevice: nanoseconds the last band took
     
-    OpenCL();
-    void createTexture();
-   	Program *compileProgram(const char *f, const char *params = NULL);
+    OpenCL(const Device *device = NULL);
+    ~OpenCL();
+    void releaseKernels();
+   	Program *compileProgram(const char *f, const char *params = NULL, bool optional = false);
+    std::string sceneDefines();
+    std::string placeBuffers();
+    std::string tunedDefines();
+    std::string deviceKey();
+    void loadProfile();
+    void saveProfile();
+    void resetFilm();
+    void updateCamera();
+    void finishLaunch();
+    void copyRows(OpenCL *to, int y0, int y1);
+    int rowAlign();
+#ifndef INTEROP
+    void scheduleFrame(cl_uchar *active, cl_uint *spp);
+    void traceRows(int y0, int n);
+    void resolveRows(const Accum *accum, int y0, int n, Pixel *image);
+#endif
+    void autotune();
+#ifdef KERNEL_CACHE
+    std::string binaryPath(const char *f, const std::string &options);
+    Program *loadBinary(const std::string &path, const std::string &options);
+    void saveBinary(const std::string &path);
+#endif
 	void createKernel();
     void createBuffers();
 	void executeKernel();
+    void executeWavefront();
+    cl_uint compactPaths(Buffer &live, cl_uint count, Buffer &next, int bounce);
+    void sortRays(Buffer &live, cl_uint count, Buffer &scratch, Event *start, Event *end);
+    void readFrame(Vector *frame);
     
 };
 
@@ -0,0 +1,225 @@
+//
+//  packet.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef Oculus_packet_h
+#define Oculus_packet_h
+
+// SIMD ray packets for the CPU backend: PACKET_WIDTH coherent rays walk the BVH
+// together and a node is entered when any of them hits its box. Included after
+// integrator.h, scene_intersect stays the single ray fallback.
+
+#if defined(USE_PACKETS) && defined(USE_BVH) && (defined(__AVX512F__) || defined(__AVX2__))
+
+#include <immintrin.h>
+
+#if defined(__AVX512F__)
+
+#define PACKET_WIDTH 16
+
+typedef __m512 vfloat;
+typedef __mmask16 vmask;
+
+inline vfloat vset(const float a) { return _mm512_set1_ps(a); }
+inline vfloat vload(const float *p) { return _mm512_loadu_ps(p); }
+inline void vstore(float *p, const vfloat a) { _mm512_storeu_ps(p, a); }
+inline vfloat vadd(const vfloat a, const vfloat b) { return _mm512_add_ps(a, b); }
+inline vfloat vsub(const vfloat a, const vfloat b) { return _mm512_sub_ps(a, b); }
+inline vfloat vmul(const vfloat a, const vfloat b) { return _mm512_mul_ps(a, b); }
+inline vfloat vdiv(const vfloat a, const vfloat b) { return _mm512_div_ps(a, b); }
+inline vfloat vmin(const vfloat a, const vfloat b) { return _mm512_min_ps(a, b); }
+inline vfloat vmax(const vfloat a, const vfloat b) { return _mm512_max_ps(a, b); }
+inline vfloat vsqrt(const vfloat a) { return _mm512_sqrt_ps(a); }
+inline vfloat vabs(const vfloat a) { return _mm512_abs_ps(a); }
+inline vmask vlt(const vfloat a, const vfloat b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+inline vmask vle(const vfloat a, const vfloat b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+inline vmask vand(const vmask a, const vmask b) { return a & b; }
+inline vfloat vselect(const vmask m, const vfloat a, const vfloat b) { return _mm512_mask_blend_ps(m, b, a); }
+inline int vbits(const vmask m) { return m; }
+inline vmask vfirst(const int n) { return (vmask)((1u << n) - 1); }
+
+#else
+
+#define PACKET_WIDTH 8
+
+typedef __m256 vfloat;
+typedef __m256 vmask;
+
+inline vfloat vset(const float a) { return _mm256_set1_ps(a); }
+inline vfloat vload(const float *p) { return _mm256_loadu_ps(p); }
+inline void vstore(float *p, const vfloat a) { _mm256_storeu_ps(p, a); }
+inline vfloat vadd(const vfloat a, const vfloat b) { return _mm256_add_ps(a, b); }
+inline vfloat vsub(const vfloat a, const vfloat b) { return _mm256_sub_ps(a, b); }
+inline vfloat vmul(const vfloat a, const vfloat b) { return _mm256_mul_ps(a, b); }
+inline vfloat vdiv(const vfloat a, const vfloat b) { return _mm256_div_ps(a, b); }
+inline vfloat vmin(const vfloat a, const vfloat b) { return _mm256_min_ps(a, b); }
+inline vfloat vmax(const vfloat a, const vfloat b) { return _mm256_max_ps(a, b); }
+inline vfloat vsqrt(const vfloat a) { return _mm256_sqrt_ps(a); }
+inline vfloat vabs(const vfloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+inline vmask vlt(const vfloat a, const vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline vmask vle(const vfloat a, const vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+inline vmask vand(const vmask a, const vmask b) { return _mm256_and_ps(a, b); }
+inline vfloat vselect(const vmask m, const vfloat a, const vfloat b) { return _mm256_blendv_ps(b, a, m); }
+inline int vbits(const vmask m) { return _mm256_movemask_ps(m); }
+inline vmask vfirst(const int n) {
+	return _mm256_cmp_ps(_mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f), _mm256_set1_ps((float)n), _CMP_LT_OQ);
+}
+
+#endif
+
+// nodes visited before the packet checks how many of its lanes are still busy
+#define PACKET_PROBE 16
+
+typedef struct {
+	vfloat ox, oy, oz;
+	vfloat dx, dy, dz;
+	vfloat ix, iy, iz;      // inverse direction, for the slab test
+	vfloat t;               // closest hit so far
+	vmask valid;            // lanes carrying a ray
+	unsigned int pid[PACKET_WIDTH];
+} RayPacket;
+
+inline void packet_init(RayPacket *p, const Ray *rays, const int n)
+{
+	float o[3][PACKET_WIDTH], d[3][PACKET_WIDTH];
+	for (int i = 0; i < PACKET_WIDTH; i ++) {
+		const Ray *r = rays + (i < n ? i : 0);
+		for (int k = 0; k < 3; k ++) {
+			o[k][i] = r->o.s[k];
+			d[k][i] = r->d.s[k];
+		}
+		p->pid[i] = P_NONE;
+	}
+
+	p->ox = vload(o[0]); p->oy = vload(o[1]); p->oz = vload(o[2]);
+	p->dx = vload(d[0]); p->dy = vload(d[1]); p->dz = vload(d[2]);
+	p->ix = vdiv(vset(1.f), p->dx);
+	p->iy = vdiv(vset(1.f), p->dy);
+	p->iz = vdiv(vset(1.f), p->dz);
+	p->t = vset(FLT_MAX);
+	p->valid = vfirst(n);
+}
+
+// lanes whose ray crosses the box closer than their current hit
+inline vmask packet_box(const RayPacket *p, BVH_SPACE BVHNode *n)
+{
+	const vfloat tx0 = vmul(vsub(vset(n->min.x), p->ox), p->ix);
+	const vfloat tx1 = vmul(vsub(vset(n->max.x), p->ox), p->ix);
+	const vfloat ty0 = vmul(vsub(vset(n->min.y), p->oy), p->iy);
+	const vfloat ty1 = vmul(vsub(vset(n->max.y), p->oy), p->iy);
+	const vfloat tz0 = vmul(vsub(vset(n->min.z), p->oz), p->iz);
+	const vfloat tz1 = vmul(vsub(vset(n->max.z), p->oz), p->iz);
+
+	const vfloat tmin = vmax(vmax(vmin(tx0, tx1), vmin(ty0, ty1)), vmax(vmin(tz0, tz1), vset(0.f)));
+	const vfloat tmax = vmin(vmin(vmax(tx0, tx1), vmax(ty0, ty1)), vmin(vmax(tz0, tz1), p->t));
+	return vand(vle(tmin, tmax), p->valid);
+}
+
+// sphere_distance for every lane
+inline vfloat packet_sphere(const RayPacket *p, PRIM_SPACE Sphere *s)
+{
+	const vfloat vx = vsub(vset(s->c.x), p->ox);
+	const vfloat vy = vsub(vset(s->c.y), p->oy);
+	const vfloat vz = vsub(vset(s->c.z), p->oz);
+
+	const vfloat b = vadd(vadd(vmul(vx, p->dx), vmul(vy, p->dy)), vmul(vz, p->dz));
+	const vfloat vv = vadd(vadd(vmul(vx, vx), vmul(vy, vy)), vmul(vz, vz));
+	const vfloat d = vadd(vsub(vmul(b, b), vv), vset(s->r * s->r));
+
+	const vfloat sq = vsqrt(vmax(d, vset(0.f)));
+	const vfloat t0 = vsub(b, sq);
+	const vfloat t1 = vadd(b, sq);
+	const vfloat t = vselect(vlt(vset(0.f), t0), t0, vselect(vlt(vset(0.f), t1), t1, vset(FLT_MAX)));
+	return vselect(vle(vset(0.f), d), t, vset(FLT_MAX));
+}
+
+// triangle_distance (Moller - Trumbore) for every lane
+inline vfloat packet_triangle(const RayPacket *p, PRIM_SPACE Triangle *tr)
+{
+	const Vector e0 = tr->p[1] - tr->p[0];
+	const Vector e1 = tr->p[2] - tr->p[0];
+
+	const vfloat ox = vsub(p->ox, vset(tr->p[0].x));
+	const vfloat oy = vsub(p->oy, vset(tr->p[0].y));
+	const vfloat oz = vsub(p->oz, vset(tr->p[0].z));
+
+	// p = d x e1
+	const vfloat px = vsub(vmul(p->dy, vset(e1.z)), vmul(p->dz, vset(e1.y)));
+	const vfloat py = vsub(vmul(p->dz, vset(e1.x)), vmul(p->dx, vset(e1.z)));
+	const vfloat pz = vsub(vmul(p->dx, vset(e1.y)), vmul(p->dy, vset(e1.x)));
+
+	// divides like the scalar test rather than multiplying by 1 / det, so
+	// both find bitwise the same hits (with -ffp-contract=off, no fused scalar ops)
+	const vfloat det = vadd(vadd(vmul(px, vset(e0.x)), vmul(py, vset(e0.y))), vmul(pz, vset(e0.z)));
+	vmask ok = vle(vset(EPSILON), vabs(det));
+
+	const vfloat u = vdiv(vadd(vadd(vmul(px, ox), vmul(py, oy)), vmul(pz, oz)), det);
+	ok = vand(ok, vand(vle(vset(0.f), u), vle(u, vset(1.f))));
+
+	// q = o x e0
+	const vfloat qx = vsub(vmul(oy, vset(e0.z)), vmul(oz, vset(e0.y)));
+	const vfloat qy = vsub(vmul(oz, vset(e0.x)), vmul(ox, vset(e0.z)));
+	const vfloat qz = vsub(vmul(ox, vset(e0.y)), vmul(oy, vset(e0.x)));
+
+	// same bounds on v as the scalar test
+	const vfloat v = vdiv(vadd(vadd(vmul(qx, p->dx), vmul(qy, p->dy)), vmul(qz, p->dz)), det);
+	ok = vand(ok, vand(vle(vset(0.f), v), vle(v, vset(1.f))));
+
+	const vfloat t = vdiv(vadd(vadd(vmul(qx, vset(e1.x)), vmul(qy, vset(e1.y))), vmul(qz, vset(e1.z))), det);
+	ok = vand(ok, vlt(vset(0.f), t));
+
+	return vselect(ok, t, vset(FLT_MAX));
+}
+
+// closest hits of the packet over the skip list BVH; gives up and returns false
+// once too few lanes take part in the visited nodes, the rays then go one by one
+static bool packet_intersect(
+	__global counter_t *counter,
+	PRIM_SPACE Primitive *primitives,
+	BVH_SPACE BVHNode *bvh,
+	RayPacket *p)
+{
+	const int width = __builtin_popcount(vbits(p->valid));
+	int visited = 0;
+	int lanes = 0;
+
+	int cur = 0;
+	int end = bvh->skip;
+
+	while (cur < end) {
+		BVH_SPACE BVHNode *n = bvh + cur;
+		COUNTER(1);
+		const vmask hit = packet_box(p, n);
+		const int bits = vbits(hit);
+		if (!bits) {
+			cur = n->skip;
+			continue;
+		}
+
+		for (uint i = 0; i < n->count; i ++) {
+			PRIM_SPACE Primitive *s = primitives + n[i].pid;
+			COUNTER(2);
+			const vfloat d = s->t == sphere ? packet_sphere(p, &s->sphere) : packet_triangle(p, &s->triangle);
+			const vmask closer = vand(hit, vlt(d, p->t));
+			p->t = vselect(closer, d, p->t);
+			for (int b = vbits(closer); b; b &= b - 1)
+				p->pid[__builtin_ctz(b)] = n[i].pid;
+		}
+		cur = n->pid != P_NONE ? n->skip : cur + 1;
+
+		visited ++;
+		lanes += __builtin_popcount(bits);
+		if (visited >= PACKET_PROBE && lanes < PACKET_COHERENCE * width * visited)
+			return false;
+	}
+
+	return true;
+}
+
+#endif
+
+#endif
@@ -9,11 +9,20 @@
 #ifndef Oculus_primitives_h
 #define Oculus_primitives_h
 
+// scene features the integrator is compiled for, the CPU backend passes them as a
+// template argument; the type tests fold to constants when only one type is present
+#ifndef FEATURES
+#define FEATURES FEATURE_ALL
+#endif
+
+#define IS_SPHERE(p) ((FEATURES & FEATURE_SPHERES) && (!(FEATURES & FEATURE_TRIANGLES) || (p)->t == sphere))
+#define IS_TRIANGLE(p) ((FEATURES & FEATURE_TRIANGLES) && (!(FEATURES & FEATURE_SPHERES) || (p)->t == triangle))
+
 #ifdef DEBUG
-static void dump_primitives(BUFFER_CONST_TYPE Primitive *primitives, int num)
+static void dump_primitives(PRIM_SPACE Primitive *primitives, int num)
 {
 	for (int i = 0; i < num; i ++) {
-		BUFFER_CONST_TYPE Primitive *p = primitives + i;
+		PRIM_SPACE Primitive *p = primitives + i;
 		
 		if (p->t == sphere) {
 			printf("[%d] s: (%.2f, %.2f, %.2f), %.2f\n", i, p->sphere.c.x, p->sphere.c.y ,p->sphere.c.z, p->sphere.r);
@@ -31,7 +40,7 @@ static void dump_primitives(BUFFER_CONST_TYPE Primitive *primitives, int num)
 #endif
 
 // optimized; assumes ray direction is normalized (so the 'a' term can be 1.f)
-inline float sphere_distance(BUFFER_CONST_TYPE Sphere *s, const Ray *ray)
+static inline float sphere_distance(PRIM_SPACE Sphere *s, const Ray *ray)
 {
 	// inverting this saves negating b
 	Vector v = s->c - ray->o;
@@ -52,7 +61,7 @@ inline float sphere_distance(BUFFER_CONST_TYPE Sphere *s, const Ray *ray)
 	return FLT_MAX;
 }
 
-inline Vector sphere_surfacepoint(BUFFER_CONST_TYPE Sphere *s, const float u, const float v)
+static inline Vector sphere_surfacepoint(PRIM_SPACE Sphere *s, const float u, const float v)
 {
 	const float z = 1.f - 2.f * u;				// z in [-1, 1] -> z = cos w
 	const float r = sqrt(max(0.f, 1 - z * z));	// sqrt(1 - x^2) -> sin w
@@ -60,15 +69,15 @@ inline Vector sphere_surfacepoint(BUFFER_CONST_TYPE Sphere *s, const float u, co
 	const float x = r * cos(p);
 	const float y = r * sin(p);
 	
-	return s->c + s->r * (Vector)(x, y, x);
+	return s->c + s->r * make_vector(x, y, x);
 }
 
-inline Vector sphere_normal(BUFFER_CONST_TYPE Sphere *s, const Vector hit_point)
+static inline Vector sphere_normal(PRIM_SPACE Sphere *s, const Vector hit_point)
 {
 	return normalize(hit_point - s->c);
 }
 
-//inline Vector sphere_tangent(BUFFER_CONST_TYPE Sphere *s, const Vector hit_point)
+//inline Vector sphere_tangent(PRIM_SPACE Sphere *s, const Vector hit_point)
 //{
 //    Vector u = hit_point - s->c;
 //    
@@ -82,7 +91,7 @@ inline Vector sphere_normal(BUFFER_CONST_TYPE Sphere *s, const Vector hit_point)
 //}
 
 // Moller - Trumbore method
-inline float triangle_distance(BUFFER_CONST_TYPE Triangle *t, const Ray *r)
+static inline float triangle_distance(PRIM_SPACE Triangle *t, const Ray *r)
 {
 	const Vector edge[2] = { (t->p[1] - t->p[0]), (t->p[2] - t->p[0]) };
 	
@@ -106,7 +115,7 @@ inline float triangle_distance(BUFFER_CONST_TYPE Triangle *t, const Ray *r)
 	return ret > 0.f ? ret : FLT_MAX;
 }
 
-inline Vector triangle_surfacepoint(BUFFER_CONST_TYPE Triangle *t, const float u, const float v)
+static inline Vector triangle_surfacepoint(PRIM_SPACE Triangle *t, const float u, const float v)
 {
 	const Vector edge[2] = { (t->p[1] - t->p[0]), (t->p[2] - t->p[0]) };
     
@@ -114,7 +123,7 @@ inline Vector triangle_surfacepoint(BUFFER_CONST_TYPE Triangle *t, const float u
 	return t->p[0] + edge[0] * u + edge[1] * v;
 }
 
-inline Vector triangle_normal(BUFFER_CONST_TYPE Triangle *t, const Vector hit_point)
+static inline Vector triangle_normal(PRIM_SPACE Triangle *t, const Vector hit_point)
 {
 	const Vector edge[2] = { (t->p[1] - t->p[0]), (t->p[2] - t->p[0]) };
     
@@ -122,7 +131,7 @@ inline Vector triangle_normal(BUFFER_CONST_TYPE Triangle *t, const Vector hit_po
 }
 
 
-//inline textcoord_t triangle_textcoords(BUFFER_CONST_TYPE Triangle *t, const Vector hit_point)
+//inline textcoord_t triangle_textcoords(PRIM_SPACE Triangle *t, const Vector hit_point)
 //{
 //    const Vector edge[2] = { (t->p[1] - t->p[0]), (t->p[2] - t->p[0]) };
 //    const float2 len2 = { pow(length(edge[0]), 2), pow(length(edge[1]), 2) };
@@ -131,31 +140,31 @@ inline Vector triangle_normal(BUFFER_CONST_TYPE Triangle *t, const Vector hit_po
 //    return uv / len2;
 //}
 
-static float primitive_distance(BUFFER_CONST_TYPE Primitive *p, const Ray *r)
+static float primitive_distance(PRIM_SPACE Primitive *p, const Ray *r)
 {
-	if (p->t == sphere) {
+	if (IS_SPHERE(p)) {
 		return sphere_distance(&p->sphere, r);
-	} else if (p->t == triangle) {
+	} else if (IS_TRIANGLE(p)) {
 		return triangle_distance(&p->triangle, r);
 	}
 	return 0.f;
 }
 
-static Vector primitive_surfacepoint(BUFFER_CONST_TYPE Primitive *p, const float a, const float b)
+static Vector primitive_surfacepoint(PRIM_SPACE Primitive *p, const float a, const float b)
 {
-	if (p->t == sphere) {
+	if (IS_SPHERE(p)) {
 		return sphere_surfacepoint(&p->sphere, a, b);
-	} else if (p->t == triangle) {
+	} else if (IS_TRIANGLE(p)) {
 		return triangle_surfacepoint(&p->triangle, a, b);
 	}
 	return vec_zero;
 }
 
-static Vector primitive_normal(BUFFER_CONST_TYPE Primitive *p, const Vector hit_point)
+static Vector primitive_normal(PRIM_SPACE Primitive *p, const Vector hit_point)
 {
-	if (p->t == sphere) {
+	if (IS_SPHERE(p)) {
 		return sphere_normal(&p->sphere, hit_point);
-	} else if(p->t == triangle) {
+	} else if (IS_TRIANGLE(p)) {
 		return triangle_normal(&p->triangle, hit_point);
 	}
 	return vec_zero;
@@ -11,20 +11,35 @@
 
 #include "geometry.h"
 
-static float randomf(random_state_t *state)
-{
-	union {
-		float f;
-		unsigned int ui;
-	} ret;
+#define PHILOX_M0 0xD2511F53
+#define PHILOX_M1 0xCD9E8D57
+#define PHILOX_W0 0x9E3779B9
+#define PHILOX_W1 0xBB67AE85
 
-	const uint a = 22222;
-	const uint b = 55555;
-	*state = (random_state_t)(a * ((state->x) & 0xFFFF) + ((state->x) >> 16), b * ((state->y) & 0xFFFF) + ((state->y) >> 16));
-	
-	ret.ui = (((state->x) << 16) + (state->y) & 0x007fffff) | 0x40000000;
+// Philox4x32-10 counter based generator (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"),
+// stateless: the same counter and key always give the same number, on any device
+static uint philox(uint c0, uint c1, uint c2, uint c3, uint k0, uint k1)
+{
+	for (int i = 0; i < 10; i++) {
+		const ulong p0 = (ulong)PHILOX_M0 * c0;
+		const ulong p1 = (ulong)PHILOX_M1 * c2;
+		
+		c0 = (uint)(p1 >> 32) ^ c1 ^ k0;
+		c1 = (uint)p1;
+		c2 = (uint)(p0 >> 32) ^ c3 ^ k1;
+		c3 = (uint)p0;
+		
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
 	
-	return (ret.f - 2.f) / 2.f;
+	return c0;
+}
+
+// uniform number in [0, 1) keyed by pixel, sample index and dimension under the scene seed
+inline float random_uniform(const uint pixel, const uint index, const uint dim, const uint seed)
+{
+	return (philox(pixel, index, dim, 0, seed, 0) >> 8) * (1.f / 16777216.f);
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -10,7 +10,7 @@
 #define _RAY_H
 
 #include "geometry.h"
-#include "random.h"
+#include "sampler.h"
 
 inline Vector vector_rotate(const Vector normal, const float s0, const float s1)
 {
@@ -40,10 +40,13 @@ inline void ray_refraction(Ray *ray, const Vector hit_point, const Vector normal
 	ray->d = normalize(n * ray->d - (n * cos_i + cos_t) * normal);
 }
 
-inline void ray_bounce(Ray *ray, const Vector hit_point, const Vector normal, random_state_t *rnd)
+inline void ray_bounce(Ray *ray, const Vector hit_point, const Vector normal, Sampler *smp)
 {
+	const float s0 = sampler_next(smp);
+	const float s1 = sampler_next(smp);
+	
 	ray->o = hit_point + normal * EPSILON;
-	ray->d = vector_rotate(normal, randomf(rnd), randomf(rnd));
+	ray->d = vector_rotate(normal, s0, s1);
 }
 
 #endif
\ No newline at end of file
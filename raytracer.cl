@@ -11,17 +11,13 @@
 #include "defs.h"
 #include "geometry.h"
 #include "primitives.h"
-#include "random.h"
+#include "sampler.h"
 #include "ray.h"
 
-#ifdef PROFILING
-#define COUNTER(i) atomic_inc(&counter->c[i]);
-#else
-#define COUNTER(i)
-#endif
+#include "integrator.h"
 
 #ifdef USE_BVH
-inline bool bvh_intersect2(const Ray *r, BUFFER_CONST_TYPE BVHNode *bvh)
+inline bool bvh_intersect2(const Ray *r, BVH_SPACE BVHNode *bvh)
 {
 	const Vector sd = sign(r->d) * FLT_MAX;
 
@@ -43,370 +39,266 @@ inline bool bvh_intersect2(const Ray *r, BUFFER_CONST_TYPE BVHNode *bvh)
     
     return eq0.x || eq0.y || eq1.x || eq1.y || eq2.x || eq2.y;
 }
-
-inline bool bvh_intersect(const Ray *r, BUFFER_CONST_TYPE BVHNode *bvh)
-{
-    float t0 = -0.f;
-    float t1 = FLT_MAX;
-    
-    Vector bmin = bvh->min;
-    Vector bmax = bvh->max;
-    
-    float tmin, tmax, tymin, tymax, tzmin, tzmax;
-    if (r->d.x >= 0) {
-        tmin = (bmin.x - r->o.x) / r->d.x;
-        tmax = (bmax.x - r->o.x) / r->d.x;
-    }
-    else {
-        tmin = (bmax.x - r->o.x) / r->d.x;
-        tmax = (bmin.x - r->o.x) / r->d.x;
-    }
-    if (r->d.y >= 0) {
-        tymin = (bmin.y - r->o.y) / r->d.y;
-        tymax = (bmax.y - r->o.y) / r->d.y;
-    }
-    else {
-        tymin = (bmax.y - r->o.y) / r->d.y;
-        tymax = (bmin.y - r->o.y) / r->d.y;
-    }
-    if ( (tmin > tymax) || (tymin > tmax) )
-        return false;
-    if (tymin > tmin)
-        tmin = tymin;
-    if (tymax < tmax)
-        tmax = tymax;
-    if (r->d.z >= 0) {
-        tzmin = (bmin.z - r->o.z) / r->d.z;
-        tzmax = (bmax.z - r->o.z) / r->d.z;
-    }
-    else {
-        tzmin = (bmax.z - r->o.z) / r->d.z;
-        tzmax = (bmin.z - r->o.z) / r->d.z;
-    }
-    if ( (tmin > tzmax) || (tzmin > tmax) )
-        return false;
-    if (tzmin > tmin)
-        tmin = tzmin;
-    if (tzmax < tmax)
-        tmax = tzmax;
-    return ( (tmin < t1) && (tmax > t0) );
-}
-
-#endif
-
-static bool scene_intersect(
-    __global counter_t *counter,
-    BUFFER_CONST_TYPE Primitive *primitives,
-    const int numprimitives,
-    const Ray *r,
-    BUFFER_CONST_TYPE Primitive **s,
-    BUFFER_CONST_TYPE BVHNode *bvh,
-    float *distance,
-    bool shadow_ray)
-{
-    bool hit = false;
-    
-#ifdef USE_BVH
-    int cur = 0;
-    int end = bvh->skip;
-    
-    while (cur < end) {
-        BUFFER_CONST_TYPE BVHNode *n = bvh + cur;
-        COUNTER(1);
-        if (bvh_intersect(r, n)) {
-            if (n->pid != P_NONE) {
-                BUFFER_CONST_TYPE Primitive *p = primitives + n->pid;
-                COUNTER(2);
-                const float d = primitive_distance(p, r);
-                if (d < *distance) {
-                    hit = true;
-                    if (shadow_ray) break;
-                    *distance = d;
-                    *s = p;
-                }
-            }
-            cur ++;
-        } else {
-            cur = n->skip;
-        }
-    }
-#else
-    for (int i = 0; i < numprimitives; i++) {
-        BUFFER_CONST_TYPE Primitive *p = primitives + i;
-        COUNTER(2);
-        const float d = primitive_distance(p, r);
-        if (d < *distance) {
-            hit = true;
-            if (shadow_ray) break;
-            *distance = d;
-            *s = p;
-        }
-	}
 #endif
-    
-	return hit;
-}
 
-inline float kdiff_lambert(const Ray *i, const Ray *o, const Vector normal)
+#ifndef INTEROP
+// 8 bit copy of the pixel for the window
+inline void film_rgb(__global Pixel *rgb, const uint index, const Vector pixel)
 {
-	return max(0.f, dot(i->d, normal));
+	rgb[index].r = convert_uchar_sat(pixel.x * 256);
+	rgb[index].g = convert_uchar_sat(pixel.y * 256);
+	rgb[index].b = convert_uchar_sat(pixel.z * 256);
 }
+#endif
 
-// http://en.wikipedia.org/wiki/Blinn%E2%80%93Phong_shading_model
-inline float kspec_blinnphong(const Ray *i, const Ray *o, const Vector normal, const Vector t)
+// float add on top of the 32 bit compare and swap
+inline void atomic_addf(volatile __global float *p, const float v)
 {
-	const float nshiny = 4.f;
-	const Vector h = normalize(i->d + o->d);
+	union {
+		uint u;
+		float f;
+	} old, sum;
 	
-	return pow(dot(normal, h), nshiny);
-}
-/*
-inline float kspec_gaussian(const Ray *i, const Ray *o, const Vector normal, const Vector t)
-{
-	const float m = 0.7f;
-	const Vector h = normalize(i->d + o->d);
-	float a = acos(dot(normal, h));
-	
-	return exp(-1.f * pow(a / m, 2));
+	do {
+		old.f = *p;
+		sum.f = old.f + v;
+	} while (atomic_cmpxchg((volatile __global uint *)p, old.u, sum.u) != old.u);
 }
 
-inline float kspec_beckmann(const Ray *i, const Ray *o, const Vector normal, const Vector t)
+inline void accum_add(__global Accum *accum, const uint index, const Vector sample)
 {
-	const float m = 0.7f;
-	const Vector h = normalize(i->d + o->d);
-	float a = acos(dot(normal, h));
-	float cos_a2 = cos(a) * cos(a);
-	float e = (1.f - cos_a2) / (cos_a2 * m * m);
+	__global Accum *a = accum + index;
+	const float lum = luminance(sample);
 	
-	return exp(-1.f * e) / (PI * m * m * cos_a2 * cos_a2);
+	atomic_addf(&a->r, sample.x);
+	atomic_addf(&a->g, sample.y);
+	atomic_addf(&a->b, sample.z);
+	atomic_addf(&a->l2, lum * lum);
+	atomic_inc(&a->n);
 }
 
-inline float kspec_heidrich_seidel(const Ray *i, const Ray *o, const Vector normal, const Vector t)
-{
-	const float ka = 1e3f;
-	const float a = dot(i->d, t);
-	const float b = dot(o->d, t);
-
-	return pow(sin(a)*sin(b) + cos(a)*cos(b), ka) * kspec_blinnphong(i, o, normal, t);
-}
-*/
-static Vector scene_illumination(
-    __global counter_t *counter,
-	BUFFER_CONST_TYPE Primitive *primitives,
-	const int numprimitives,
-	random_state_t *rnd,
-	
-	BUFFER_CONST_TYPE Primitive *s,
-	const Ray *r,
-	const Vector hit_point,
-	const Vector normal,
-	const float cos_i,
-	BUFFER_CONST_TYPE BVHNode *bvh
+// flags the pixels that still need samples and counts them, the count is summed in
+// local memory so there is one global atomic per work group instead of per pixel
+__kernel void adaptive_schedule(
+	__global counter_t *counter,
+	__global const Vector *frame,
+	__global const float *variance,
+	__global const uint *spp,
+	__global uchar *active
 	)
 {
-	Vector illu = vec_zero;
-	Vector tangent = cross(normal, normalize(r->d + 2.f * cos_i * normal));
-	
-	for (int i = 0; i < numprimitives; i++) {
-		BUFFER_CONST_TYPE Primitive *l = primitives + i;
-		if (l->m.e != 0.f) {
-			Vector light_hit = primitive_surfacepoint(l, randomf(rnd), randomf(rnd)) - normal * EPSILON; // make sure it won't collide with the primitive
-			
-			Ray s_ray = {hit_point + normal * EPSILON, normalize(light_hit - hit_point)};
-
-			BUFFER_CONST_TYPE Primitive *h;
-            float light_dist = length(light_hit - hit_point);
-			bool hit = scene_intersect(counter, primitives, numprimitives, &s_ray, &h, bvh, &light_dist, true);
-			if (!hit) {
-				Vector emission = l->m.c * l->m.e;
-
-				// Phong illumination model http://en.wikipedia.org/wiki/Phong_reflection_model
-				float attenuation = 2.f * sqrt(light_dist);
-				float kdiff = kdiff_lambert(&s_ray, r, normal);
-				float kspec = kspec_blinnphong(&s_ray, r, normal, tangent);
-
-				illu = illu + emission * (kdiff + kspec) / attenuation;
-			}
-		}
-	}
-	
-	return illu + ambient;
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	const int width = get_global_size(0);
+	const uint index = y * width + x;
+	const bool first = get_local_id(0) == 0 && get_local_id(1) == 0;
+	__local uint group_active;
+
+	if (first)
+		group_active = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	const bool sample = pixel_active(frame, variance, spp, index);
+	active[index] = sample;
+	if (sample)
+		atomic_inc(&group_active);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (first && group_active)
+		atomic_add(&counter->c[COUNTER_ACTIVE], group_active);
 }
 
-static Vector scene_sample(
-    __global counter_t *counter,
-	BUFFER_CONST_TYPE Primitive *primitives,
-	const int numprimitives,
-	random_state_t *rnd,
-	const Ray *ray,
-	BUFFER_CONST_TYPE BVHNode *bvh
-)
-{
-	int depth = 6;
-	bool bounce = true;
-	Vector sample = vec_zero;
-	Vector illum = vec_one;
-	Ray r = *ray;
-
-	while (--depth) {
-		BUFFER_CONST_TYPE Primitive *s = 0;
-		float distance = FLT_MAX;
-        bool hit = scene_intersect(counter, primitives, numprimitives, &r, &s, bvh, &distance, false);
-		if (!hit) {
-			return sample;
-		}
-		
-		// Lights
-		if (s->m.e != 0.f) {
-			// HACK?: only return full luminance when either hit by a primary ray or
-			// after a specular bounce, as diffuse already sampled it previously
-			return bounce ? (sample + illum * s->m.e * s->m.c) : sample;
-		} 
-
-		// intersection
-		Vector hit_point = r.o + r.d * distance;
-		Vector normal = primitive_normal(s, hit_point);
-		
-		// correct normals, simt style
-		float cos_i = -1.f * dot(normal, normalize(r.d));
-		float csign = sign(cos_i);
-
-		normal = normal * csign;
-		cos_i = cos_i * csign;
-		bool leaving = (csign < 0.f);
-		Surface material = s->m.s;
-		
-		illum = illum * s->m.c;
-
-		// BRDFs, TODO: move them to functions
-		// Avoiding switch decreases 8% frame time!
-		if (material == Diffuse) {
-			bounce = false;
-		
-			sample = sample + illum * scene_illumination(counter, primitives, numprimitives, rnd, s, &r, hit_point, normal, cos_i, bvh);
-            
-			ray_bounce(&r, hit_point, normal, rnd);
-		} 
-		else if (material == Metal) {
-			bounce = true;
-			//sample = sample + illum * scene_illumination(primitives, numprimitives, rnd, s, &r, hit_point, normal, cos_i, bvh);
-
-			ray_reflection(&r, hit_point, normal, cos_i);
-		}
-		else if (material == Specular) {
-			bounce = true;
-		
-			ray_reflection(&r, hit_point, normal, cos_i);
-		}
-		else if (material == Dielectric) {
-			bounce = true;
-		
-			const float air = 1.f;
-			const float glass = 1.5f;
-
-			float n1 = leaving? glass : air;
-			float n2 = leaving? air : glass;
-			float n = n1 / n2;
-
-			float cos_t2 = 1.f - pow(n, 2) * (1.f - pow(cos_i, 2));
+// cooperative copy of the top of the BVH to local memory (the root skip is the node
+// count), every work item of the group has to get here before any of them returns
+#if BVH_TREELET && defined(USE_BVH)
+#define TREELET_DECLARE(bvh) \
+	__local BVHNode treelet[BVH_TREELET]; \
+	bvh_load_treelet(treelet, bvh)
 
-			if (cos_t2 < 0.f) {
-				ray_reflection(&r, hit_point, normal, cos_i);
-			} else {
-				float cos_t = sqrt(cos_t2);
-
-				// TODO: implement Schlick approx.
-				float perp = pow((n1 * cos_i - n2 * cos_t) / (n1 * cos_i + n2 * cos_t), 2.f);
-				float para = pow((n2 * cos_i - n1 * cos_t) / (n2 * cos_i + n1 * cos_t), 2.f);
-				float fres = (perp + para) / 2.f;
-				
-				if (randomf(rnd) < fres) {
-					ray_reflection(&r, hit_point, normal, cos_i);
-				} else {
-					ray_refraction(&r, hit_point, normal, cos_i, cos_t, n);
-				}
-			}
-			
-		} 
-
-	}
-
-
-	return sample;
-}
-
-static Ray camera_genray( BUFFER_CONST_TYPE Camera *camera, float x, float y, int width, int height)
+inline void bvh_load_treelet(__local BVHNode *treelet, BVH_SPACE BVHNode *bvh)
 {
-	const float fov = radians(45.f);
-	const float fx = (float)x / width - 0.5f;
-	const float fy = (float)y / height - 0.5f;
-	const float zoom = 1.f;
-
-	Vector d = normalize(camera->t - camera->o);
-	Vector vx = normalize(cross(d, vec_y)) * (width * fov / height);
-	Vector vy = normalize(cross(vx, d)) * fov;
-	
-	return (Ray){camera->o, normalize(d + zoom * vx * fx + zoom * vy * fy)};
+	const int lid = get_local_id(1) * get_local_size(0) + get_local_id(0);
+	const int lsize = get_local_size(0) * get_local_size(1);
+	const int n = min(BVH_TREELET, (int)bvh->skip);
+	for (int i = lid; i < n; i += lsize)
+		treelet[i] = bvh[i];
+	barrier(CLK_LOCAL_MEM_FENCE);
 }
+#else
+#define TREELET_DECLARE(bvh) \
+	__local BVHNode *treelet = 0
+#endif
 
 __kernel void raytracer(
     __global counter_t *counter,
-	BUFFER_CONST_TYPE Primitive *primitives,
+	PRIM_SPACE Primitive *primitives,
 	int numprimitives,
-	BUFFER_CONST_TYPE Camera *camera,
-	random_state_t seed,
+	CAMERA_SPACE Camera *camera,
+	uint seed,
 	__global Vector *frame,
+	__global float *variance,
+	__global uint *spp,
+	__global const uchar *active,
 #ifdef INTEROP
 	write_only image2d_t image,
 #else
 	__global Pixel *rgb,
 #endif
 	unsigned int samples,
-	BUFFER_CONST_TYPE BVHNode *bvh,
-	int numbvh
+	BVH_SPACE BVHNode *bvh,
+	int height
 	)
 {
-	// work items and size
+	// work items and size, a band of the rows when several devices share the image
 	const int x = get_global_id(0);
 	const int y = get_global_id(1);
 	const int width = get_global_size(0);
-	const int height = get_global_size(1);
+	const uint index = y * width + x;
+	TREELET_DECLARE(bvh);
+
+	// converged pixels keep their last value; the launches alternate between two
+	// images, so it is written again into the one this launch fills
+	if (!active[index]) {
+#ifndef INTEROP
+		film_rgb(rgb, index, frame[index]);
+#endif
+		return;
+	}
 
     COUNTER(0);
     
-	// xor seed per work items
-	seed ^= (random_state_t)(x, y);
-
 #ifdef DEBUG
-	if (samples != 0 && x ==0 && y ==0) {
+	if (spp[index] != 0 && x ==0 && y ==0) {
 		dump_primitives(primitives_l, numprimitives);
 	}
 #endif
 
-	// antialiasing
-	float dx = x + randomf(&seed) - 0.5f;
-	float dy = y + randomf(&seed) - 0.5f;
-
-	// generate primary ray and path tracing
-	Ray ray = camera_genray(camera, dx, dy, width, height);
-	Vector pixel = scene_sample(counter, primitives, numprimitives, &seed, &ray, bvh);
-
-	// averages the pixel, except for the first
-	uint index = y * width + x;
-	if (samples > 1) {
-		const float k1 = samples;
-		const float k2 = 1.f / (samples + 1.f);
-		pixel = (frame[index] * k1 + pixel) * k2;
+	// several samples per launch, accumulated privately and merged once
+	const uint first = spp[index];
+	Vector sum = vec_zero;
+	float lum2 = 0.f;
+	for (uint i = 0; i < samples; i++) {
+		// per pixel sequence, keyed by the scene seed so renders are reproducible
+		Sampler smp = sampler_init(index, first + i, seed);
+
+		// antialiasing
+		float dx = x + sampler_next(&smp) - 0.5f;
+		float dy = y + sampler_next(&smp) - 0.5f;
+
+		// generate primary ray and path tracing
+		Ray ray = camera_genray(camera, dx, dy, width, height);
+		Vector pixel = scene_sample(counter, primitives, numprimitives, &smp, &ray, bvh, treelet);
+
+		const float lum = luminance(pixel);
+		sum += pixel;
+		lum2 += lum * lum;
 	}
-	frame[index] = pixel;
+
+	// accumulates the samples into the pixel mean and variance
+	film_merge(frame, variance, spp, index, sum, lum2, samples);
+	Vector pixel = frame[index];
 	
 	// return RGBA image
 #ifdef INTEROP
 	// it does the clamp by itself it seems
 	write_imagef(image, (int2)(x, y), (float4)(pixel.x, pixel.y, pixel.z, 0.f));
 #else
-	rgb[index].r = convert_uchar_sat(pixel.x * 256);
-	rgb[index].g = convert_uchar_sat(pixel.y * 256);
-	rgb[index].b = convert_uchar_sat(pixel.z * 256);
+	film_rgb(rgb, index, pixel);
 #endif
 }
+
+// persistent threads: work items keep pulling pixel samples from a global counter
+// and start a new path as soon as the previous one terminates, instead of idling
+// until the longest path of their SIMD group is done
+__kernel void raytracer_persistent(
+    __global counter_t *counter,
+	PRIM_SPACE Primitive *primitives,
+	int numprimitives,
+	CAMERA_SPACE Camera *camera,
+	uint seed,
+	__global Accum *accum,
+	__global const uint *spp,
+	__global const uchar *active,
+	int width,
+	int height,
+	unsigned int samples,
+	BVH_SPACE BVHNode *bvh
+	)
+{
+	// consecutive work is spread over the image, so two lanes rarely share a pixel
+	const uint numpixels = width * height;
+	const uint numwork = numpixels * samples;
+	TREELET_DECLARE(bvh);
+	
+	PathState path;
+	Ray ray;
+	uint pixel = 0;
+	bool alive = false;
+	
+	for (;;) {
+		if (!alive) {
+			const uint work = atomic_inc(&counter->c[COUNTER_WORK]);
+			if (work >= numwork)
+				break;
+			
+			pixel = work % numpixels;
+			if (!active[pixel])
+				continue;
+			
+			COUNTER(0);
+			
+			Sampler smp = sampler_init(pixel, spp[pixel] + work / numpixels, seed);
+			float dx = (pixel % width) + sampler_next(&smp) - 0.5f;
+			float dy = (pixel / width) + sampler_next(&smp) - 0.5f;
+			
+			ray = camera_genray(camera, dx, dy, width, height);
+			path_init(&path, &smp);
+		}
+		
+		alive = path_step(counter, primitives, numprimitives, bvh, treelet, &ray, &path);
+		if (!alive)
+			accum_add(accum, pixel, path.sample);
+	}
+}
+
+// merges the samples accumulated during the launch into the frame and clears them
+__kernel void film_resolve(
+	__global Accum *accum,
+	__global Vector *frame,
+	__global float *variance,
+	__global uint *spp,
+#ifdef INTEROP
+	write_only image2d_t image
+#else
+	__global Pixel *rgb
+#endif
+	)
+{
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	const int width = get_global_size(0);
+	const uint index = y * width + x;
+	
+	// pixels without new samples are still copied to the image of this launch
+	const Accum a = accum[index];
+	if (a.n == 0) {
+#ifndef INTEROP
+		film_rgb(rgb, index, frame[index]);
+#endif
+		return;
+	}
+	
+	film_merge(frame, variance, spp, index, (Vector)(a.r, a.g, a.b), a.l2, a.n);
+	accum[index] = (Accum){0.f, 0.f, 0.f, 0.f, 0};
+	Vector pixel = frame[index];
+	
+#ifdef INTEROP
+	write_imagef(image, (int2)(x, y), (float4)(pixel.x, pixel.y, pixel.z, 0.f));
+#else
+	film_rgb(rgb, index, pixel);
+#endif
+}
+
+#ifdef WAVEFRONT
+#include "wavefront.h"
+#endif
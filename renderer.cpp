@@ -0,0 +1,40 @@
+//
+//  renderer.cpp
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#include "renderer.h"
+#ifdef __APPLE__
+#include <OpenGL/glext.h>
+#else
+#include <GL/glext.h>
+#endif
+#include <string.h>
+
+Renderer::Renderer() {
+    width = 1024;
+    height = 768;
+    width /= DOWNSCALE;
+    height /= DOWNSCALE;
+    samples = 0;
+    launchSamples = SAMPLES_PER_LAUNCH;
+    converged = false;
+    memset(&counter, 0, sizeof(counter_t));
+    scene = NULL;
+    textid = 0;
+    rgb = NULL;
+}
+
+void Renderer::createTexture() {
+    glEnable(GL_TEXTURE_RECTANGLE_ARB);
+    glGenTextures(1, &textid);
+    
+    glBindTexture(GL_TEXTURE_RECTANGLE_ARB, textid);
+    glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindTexture(GL_TEXTURE_RECTANGLE_ARB, 0);
+}
@@ -0,0 +1,43 @@
+//
+//  renderer.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef __Oculus__renderer__
+#define __Oculus__renderer__
+
+#include "defs.h"
+#include "scene.h"
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+
+// rendering backend, the OpenCL device or the native CPU threads
+struct Renderer {
+	int width;
+	int height;
+	int samples;        // samples so far, each pixel keeps its own count
+	int launchSamples;  // samples per pixel traced by each launch
+	bool converged;     // every pixel reached the target noise level
+	counter_t counter;
+	Scene *scene;
+	
+	GLuint textid;
+	Pixel *rgb;         // 8 bit frame for the window, NULL when drawn through interop
+	
+	Renderer();
+	virtual ~Renderer() {}
+	void createTexture();
+	virtual void createBuffers() = 0;
+	virtual void createKernel() = 0;
+	virtual void executeKernel() = 0;
+	virtual void readFrame(Vector *frame) = 0;
+	virtual void updateCamera() = 0;   // the scene camera moved, the film starts over
+};
+
+#endif /* defined(__Oculus__renderer__) */
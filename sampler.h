@@ -0,0 +1,121 @@
+//
+//  sampler.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef _SAMPLER_H
+#define _SAMPLER_H
+
+#include "geometry.h"
+#include "random.h"
+
+#ifdef USE_SOBOL
+
+// Sobol direction numbers for the first four dimensions (Joe & Kuo)
+__constant uint sobol_directions[4][32] = {
+	{
+		0x80000000, 0x40000000, 0x20000000, 0x10000000, 0x08000000, 0x04000000, 0x02000000, 0x01000000,
+		0x00800000, 0x00400000, 0x00200000, 0x00100000, 0x00080000, 0x00040000, 0x00020000, 0x00010000,
+		0x00008000, 0x00004000, 0x00002000, 0x00001000, 0x00000800, 0x00000400, 0x00000200, 0x00000100,
+		0x00000080, 0x00000040, 0x00000020, 0x00000010, 0x00000008, 0x00000004, 0x00000002, 0x00000001
+	}, {
+		0x80000000, 0xc0000000, 0xa0000000, 0xf0000000, 0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+		0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000, 0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+		0x80008000, 0xc000c000, 0xa000a000, 0xf000f000, 0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+		0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0, 0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff
+	}, {
+		0x80000000, 0xc0000000, 0x60000000, 0x90000000, 0xe8000000, 0x5c000000, 0x8e000000, 0xc5000000,
+		0x68800000, 0x9cc00000, 0xee600000, 0x55900000, 0x80680000, 0xc09c0000, 0x60ee0000, 0x90550000,
+		0xe8808000, 0x5cc0c000, 0x8e606000, 0xc5909000, 0x6868e800, 0x9c9c5c00, 0xeeee8e00, 0x5555c500,
+		0x8000e880, 0xc0005cc0, 0x60008e60, 0x9000c590, 0xe8006868, 0x5c009c9c, 0x8e00eeee, 0xc5005555
+	}, {
+		0x80000000, 0xc0000000, 0x20000000, 0x50000000, 0xf8000000, 0x74000000, 0xa2000000, 0x93000000,
+		0xd8800000, 0x25400000, 0x59e00000, 0xe6d00000, 0x78080000, 0xb40c0000, 0x82020000, 0xc3050000,
+		0x208f8000, 0x51474000, 0xfbea2000, 0x75d93000, 0xa0858800, 0x914e5400, 0xdbe79e00, 0x25db6d00,
+		0x58800080, 0xe54000c0, 0x79e00020, 0xb6d00050, 0x800800f8, 0xc00c0074, 0x200200a2, 0x50050093
+	}
+};
+
+inline uint reverse_bits(uint x)
+{
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+	x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling as a hashed permutation, see Burley, "Practical Hash-based Owen Scrambling"
+inline uint laine_karras_permutation(uint x, const uint seed)
+{
+	x ^= x * 0x3d20adea;
+	x += seed;
+	x *= (seed >> 16) | 1;
+	x ^= x * 0x05526c56;
+	x ^= x * 0x53a22864;
+	return x;
+}
+
+inline uint nested_uniform_scramble(uint x, const uint seed)
+{
+	return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+static uint sobol(uint index, const uint dim)
+{
+	uint x = 0;
+	for (int bit = 0; index; index >>= 1, bit++) {
+		if (index & 1)
+			x ^= sobol_directions[dim][bit];
+	}
+	return x;
+}
+
+inline uint hash_uint(uint x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+inline uint hash_combine(const uint seed, const uint v)
+{
+	return seed ^ (hash_uint(v) + (seed << 6) + (seed >> 2));
+}
+
+#endif
+
+// sample 'index' of the pixel sequence, dimensions are drawn in order
+static Sampler sampler_init(const uint pixel, const uint index, const uint seed)
+{
+	Sampler s;
+	s.pixel = pixel;
+	s.index = index;
+	s.dim = 0;
+	s.seed = seed;
+	return s;
+}
+
+// next dimension in [0, 1); Sobol dimensions are padded in 4D groups, each
+// with its own shuffled index and scrambling seed
+static float sampler_next(Sampler *s)
+{
+#ifdef USE_SOBOL
+	const uint seed = hash_combine(hash_combine(s->seed, s->pixel), s->dim >> 2);
+	const uint index = nested_uniform_scramble(s->index, seed);
+	const uint x = nested_uniform_scramble(sobol(index, s->dim & 3), hash_combine(seed, s->dim & 3));
+	s->dim++;
+	
+	return (x >> 8) * (1.f / 16777216.f);
+#else
+	return random_uniform(s->pixel, s->index, s->dim++, s->seed);
+#endif
+}
+
+#endif
@@ -7,12 +7,40 @@
 //
 
 #include "scene.h"
+#include <math.h>
 
 void Scene::buildBVH() {
     bvhTree = new BVHTree(primitive_vector);
     
 }
 
+// FEATURE_* bits of the primitive and material types in use
+cl_uint Scene::features() const {
+    cl_uint f = 0;
+    for (size_t i = 0; i < primitive_vector.size(); i ++) {
+        const Primitive &p = primitive_vector[i];
+        f |= p.t == sphere ? FEATURE_SPHERES : FEATURE_TRIANGLES;
+        switch (p.m.s) {
+            case Diffuse: f |= FEATURE_DIFFUSE; break;
+            case Specular: f |= FEATURE_SPECULAR; break;
+            case Metal: f |= FEATURE_METAL; break;
+            case Dielectric: f |= FEATURE_DIELECTRIC; break;
+        }
+    }
+    return f;
+}
+
+// turns the camera around the vertical axis through its target by angle radians,
+// and scales its distance to the target by zoom
+void Scene::orbitCamera(float angle, float zoom) {
+    const float dx = camera.o.s[0] - camera.t.s[0];
+    const float dz = camera.o.s[2] - camera.t.s[2];
+    const float c = cosf(angle), s = sinf(angle);
+    camera.o.s[0] = camera.t.s[0] + zoom * (c * dx - s * dz);
+    camera.o.s[1] = camera.t.s[1] + zoom * (camera.o.s[1] - camera.t.s[1]);
+    camera.o.s[2] = camera.t.s[2] + zoom * (s * dx + c * dz);
+}
+
 Vector Scene::getVector(JSON_Array *vector_array) {
     if (json_array_get_count(vector_array) != 3) {
         throw "reading vector ";
@@ -24,16 +52,16 @@ Vector Scene::getVector(JSON_Array *vector_array) {
     return v;
 }
 
-void Scene::testScene() {
-    int n = 10;
-    int r = 100/n/2 - 1;
-    int ofs = 100/n;
-    int cofs = ofs/2;
+// n^3 spheres in a 100 units cube, large n gives BVHs bigger than the caches
+void Scene::testScene(int n) {
+    float ofs = 100.f / n;
+    float r = 0.4f * ofs;
+    float cofs = ofs / 2;
     for (int i = 0; i < n; i ++)
         for (int j = 0; j < n; j ++)
             for (int k = 0; k < n; k ++) {
                 Primitive s;
-                s.sphere.c = (Vector){{static_cast<cl_float>(cofs + i * ofs), static_cast<cl_float>(cofs + j * ofs), static_cast<cl_float>(cofs + k * ofs)}};
+                s.sphere.c = (Vector){{cofs + i * ofs, cofs + j * ofs, cofs + k * ofs}};
                 s.sphere.r = r;
                 s.t = sphere;
                 s.m.c = (Vector){{0.9f * i / n, 0.9f * j / n, 0.9f * k / n}};
@@ -54,6 +82,8 @@ void Scene::testScene() {
     
     camera.o = (Vector){{100.f, 200.f, 200.f}};
     camera.t = (Vector){{50.f, 50.f, 50.f}};
+    seed = 0;
+    sortRays = false;
     
 }
 
@@ -75,6 +105,15 @@ void Scene::loadJson(const char *f) {
         
         camera.o = getVector(json_object_dotget_array(_scene, "camera.origin"));
         camera.t = getVector(json_object_dotget_array(_scene, "camera.target"));
+        JSON_Value *_seed = json_object_get_value(_scene, "seed");
+        if (_seed) {
+            double value = json_value_get_number(_seed);
+            if (json_value_get_type(_seed) != JSONNumber || value < 0 || value > 4294967295.0 || value != floor(value)) {
+                throw "seed must be an integer in [0, 2^32)";
+            }
+            seed = (cl_uint)value;
+        }
+        sortRays = json_object_get_boolean(_scene, "sort_rays") == 1;
         
         JSON_Array *_materials = json_object_get_array(_scene, "materials");
         if (!_materials) {
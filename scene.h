@@ -19,12 +19,16 @@
 
 struct Scene {
 	Camera camera;
+	cl_uint seed;       // keys every sample stream, same seed renders the same image
+	bool sortRays;      // wavefront: reorder rays by origin and direction before extend
 	std::map<std::string, Material> material_map;
 	std::vector<Primitive> primitive_vector;
 	BVHTree *bvhTree;
     
     void buildBVH();
-    void testScene();
+    cl_uint features() const;
+    void orbitCamera(float angle, float zoom);
+    void testScene(int n = 10);
     Vector getVector(JSON_Array *vector_array);
     void loadJson(const char *f);
 };
@@ -0,0 +1,88 @@
+//
+//  threadpool.cpp
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int n) : queued(0), pending(0), next(0), stop(false) {
+    for (int i = 0; i < n; i ++)
+        queues.push_back(new Queue());
+    for (int i = 0; i < n; i ++)
+        threads.push_back(std::thread(&ThreadPool::worker, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> l(lock);
+        stop = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < threads.size(); i ++)
+        threads[i].join();
+    for (size_t i = 0; i < queues.size(); i ++)
+        delete queues[i];
+}
+
+void ThreadPool::push(const Task &task) {
+    Queue *q = queues[next++ % queues.size()];
+    pending ++;
+    {
+        std::lock_guard<std::mutex> l(q->lock);
+        q->tasks.push_back(task);
+    }
+    {
+        std::lock_guard<std::mutex> l(lock);
+        queued ++;
+    }
+    wake.notify_one();
+}
+
+// blocks until every task pushed so far has finished
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> l(lock);
+    done.wait(l, [this] { return pending == 0; });
+}
+
+bool ThreadPool::pop(int id, Task &task) {
+    for (size_t i = 0; i < queues.size(); i ++) {
+        Queue *q = queues[(id + i) % queues.size()];
+        std::lock_guard<std::mutex> l(q->lock);
+        if (q->tasks.empty())
+            continue;
+        
+        // own queue LIFO, stolen work FIFO
+        if (i == 0) {
+            task = q->tasks.back();
+            q->tasks.pop_back();
+        } else {
+            task = q->tasks.front();
+            q->tasks.pop_front();
+        }
+        queued --;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::worker(int id) {
+    Task task;
+    for (;;) {
+        if (pop(id, task)) {
+            task();
+            if (--pending == 0) {
+                std::lock_guard<std::mutex> l(lock);
+                done.notify_all();
+            }
+            continue;
+        }
+        
+        std::unique_lock<std::mutex> l(lock);
+        wake.wait(l, [this] { return stop || queued > 0; });
+        if (stop && queued == 0)
+            return;
+    }
+}
@@ -0,0 +1,48 @@
+//
+//  threadpool.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef __Oculus__threadpool__
+#define __Oculus__threadpool__
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+// work stealing pool: tasks are dealt round robin to per worker queues, a
+// worker runs its own queue from the back and steals from the front of the others
+struct ThreadPool {
+	typedef std::function<void()> Task;
+	
+	struct Queue {
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+	
+	std::vector<std::thread> threads;
+	std::vector<Queue *> queues;
+	std::mutex lock;
+	std::condition_variable wake, done;
+	std::atomic<int> queued;    // pushed and not taken yet
+	std::atomic<int> pending;   // pushed and not finished yet
+	unsigned int next;
+	bool stop;
+	
+	ThreadPool(int n);
+	~ThreadPool();
+	int size() const { return (int)threads.size(); }
+	void push(const Task &task);
+	void wait();
+	bool pop(int id, Task &task);
+	void worker(int id);
+};
+
+#endif /* defined(__Oculus__threadpool__) */
@@ -12,6 +12,7 @@
 #include <sys/time.h>
 #include <algorithm>
 #include <iomanip>
+#include <iostream>
 
 static double wallclock() {
 	struct timeval t;
@@ -37,7 +38,15 @@ static Vector operator-(const Vector &a, const float &b) {
 }
 
 static Vector operator*(const Vector &a, const Vector &b) {
-	return (Vector){{a.x * b.x, a.y * b.x, a.z * b.x}};
+	return (Vector){{a.x * b.x, a.y * b.y, a.z * b.z}};
+}
+
+static Vector operator*(const float &a, const Vector &b) {
+	return (Vector){{a * b.x, a * b.y, a * b.z}};
+}
+
+static Vector operator-(const Vector &a) {
+	return (Vector){{-a.x, -a.y, -a.z}};
 }
 
 static Vector operator*(const Vector &a, const float &b) {
@@ -0,0 +1,562 @@
+//
+//  wavefront.h
+//  Oculus
+//
+//  Created by Manuel Broncano Rodriguez on 6/12/13.
+//  Copyright (c) 2013 Manuel Broncano Rodriguez. All rights reserved.
+//
+
+#ifndef _WAVEFRONT_H
+#define _WAVEFRONT_H
+
+// Wavefront path tracer, see Laine et al. "Megakernels Considered Harmful".
+// The megakernel is split in stage kernels run once per bounce: generate, extend
+// (closest hit), connect (direct lighting) and one shading kernel per material.
+// Path state and rays live in global buffers indexed by path, paths are handed
+// from extend to the shading stages sorted by material, so each shading kernel
+// runs over a contiguous and coherent batch.
+
+inline void path_deposit(__global Accum *accum, __global PathState *path)
+{
+	accum_add(accum, path->smp.pixel, path->sample);
+	path->depth = 0;
+}
+
+// one path per active pixel, inactive pixels start dead and are compacted away
+__kernel void wf_generate(
+	CAMERA_SPACE Camera *camera,
+	uint seed,
+	__global const uint *spp,
+	__global const uchar *active,
+	__global PathState *paths,
+	__global Ray *rays,
+	__global uint *live,
+	unsigned int pass
+	)
+{
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	const int width = get_global_size(0);
+	const int height = get_global_size(1);
+	const uint index = y * width + x;
+	
+	live[index] = index;
+	if (!active[index]) {
+		paths[index].depth = 0;
+		return;
+	}
+	
+	Sampler smp = sampler_init(index, spp[index] + pass, seed);
+	float dx = x + sampler_next(&smp) - 0.5f;
+	float dy = y + sampler_next(&smp) - 0.5f;
+	
+	PathState path;
+	path_init(&path, &smp);
+	paths[index] = path;
+	rays[index] = camera_genray(camera, dx, dy, width, height);
+}
+
+// closest hit for every live path; misses and lights terminate the path right
+// away, surface hits are keyed by material for sorting
+__kernel void wf_extend(
+	__global counter_t *counter,
+	PRIM_SPACE Primitive *primitives,
+	int numprimitives,
+	BVH_SPACE BVHNode *bvh,
+	__global PathState *paths,
+	__global const Ray *rays,
+	__global Hit *hits,
+	__global uint *keys,
+	__global Accum *accum,
+	__global const uint *live
+	)
+{
+	TREELET_DECLARE(bvh);
+	const uint id = live[get_global_id(0)];
+	__global PathState *path = paths + id;
+	
+	keys[get_global_id(0)] = NUM_MATERIALS;
+	
+	const Ray r = rays[id];
+	PRIM_SPACE Primitive *s = 0;
+	float distance = FLT_MAX;
+	if (!scene_intersect(counter, primitives, numprimitives, &r, &s, bvh, treelet, &distance, false)) {
+		path_deposit(accum, path);
+		return;
+	}
+	
+	// see path_step
+	if (s->m.e != 0.f) {
+		if (path->bounce)
+			path->sample = path->sample + path->illum * s->m.e * s->m.c;
+		path_deposit(accum, path);
+		return;
+	}
+	
+	hits[id] = (Hit){(uint)(s - primitives), distance};
+	keys[get_global_id(0)] = s->m.s;
+}
+
+// Counting sort of the live paths by material key: per group histograms, an
+// exclusive scan over them (material major) and a stable scatter. Keys past
+// NUM_MATERIALS (terminated paths) are dropped.
+__kernel void wf_sort_count(
+	__global const uint *keys,
+	unsigned int count,
+	__global uint *hist
+	)
+{
+	__local uint local_hist[NUM_MATERIALS];
+	const uint id = get_global_id(0);
+	const uint lid = get_local_id(0);
+	
+	if (lid < NUM_MATERIALS)
+		local_hist[lid] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	if (id < count && keys[id] < NUM_MATERIALS)
+		atomic_inc(&local_hist[keys[id]]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	if (lid < NUM_MATERIALS)
+		hist[lid * get_num_groups(0) + get_group_id(0)] = local_hist[lid];
+}
+
+// exclusive scan of n values by a single work group of WAVEFRONT_GROUP items, a
+// Hillis-Steele scan per chunk carrying the running sum; returns sum plus the total
+inline uint wf_group_scan(__global uint *data, const uint n, uint sum, __local uint *scan)
+{
+	const uint lid = get_local_id(0);
+	
+	for (uint base = 0; base < n; base += WAVEFRONT_GROUP) {
+		const uint i = base + lid;
+		const uint v = i < n ? data[i] : 0;
+		
+		scan[lid] = v;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (uint offset = 1; offset < WAVEFRONT_GROUP; offset <<= 1) {
+			const uint s = lid >= offset ? scan[lid - offset] : 0;
+			barrier(CLK_LOCAL_MEM_FENCE);
+			scan[lid] += s;
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+		
+		if (i < n)
+			data[i] = sum + scan[lid] - v;
+		sum += scan[WAVEFRONT_GROUP - 1];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	return sum;
+}
+
+// one work group, the histogram is only NUM_MATERIALS entries per group
+__kernel void wf_sort_scan(
+	__global uint *hist,
+	unsigned int numgroups,
+	__global uint *queue_count
+	)
+{
+	__local uint scan[WAVEFRONT_GROUP];
+	uint sum = 0;
+	for (uint m = 0; m < NUM_MATERIALS; m++) {
+		const uint first = sum;
+		sum = wf_group_scan(hist + m * numgroups, numgroups, sum, scan);
+		if (get_local_id(0) == 0)
+			queue_count[m] = sum - first;
+	}
+}
+
+__kernel void wf_sort_scatter(
+	__global const uint *keys,
+	unsigned int count,
+	__global const uint *hist,
+	__global uint *queues,
+	__global const uint *live
+	)
+{
+	__local uint local_keys[WAVEFRONT_GROUP];
+	const uint id = get_global_id(0);
+	const uint lid = get_local_id(0);
+	const uint key = id < count ? keys[id] : NUM_MATERIALS;
+	
+	local_keys[lid] = key;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	if (key >= NUM_MATERIALS)
+		return;
+	
+	// rank among the same keys of the group, keeps the path order
+	uint rank = 0;
+	for (uint i = 0; i < lid; i++)
+		rank += (local_keys[i] == key);
+	
+	queues[hist[key * get_num_groups(0) + get_group_id(0)] + rank] = live[id];
+}
+
+// Optional ray reordering before extend: a 24 bit key with the direction octant
+// on top of the Morton code of the origin cell (7 bits per axis, scene bounds
+// from the BVH root), sorted by a 4 bit LSD radix sort. Neighbouring lanes then
+// traverse the BVH along similar paths.
+#define RADIX_BINS (1 << RADIX_BITS)
+
+inline uint morton_spread(uint x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x30000ff;
+	x = (x | (x << 8)) & 0x300f00f;
+	x = (x | (x << 4)) & 0x30c30c3;
+	x = (x | (x << 2)) & 0x9249249;
+	return x;
+}
+
+__kernel void wf_ray_keys(
+	BVH_SPACE BVHNode *bvh,
+	__global const Ray *rays,
+	__global const uint *live,
+	unsigned int count,
+	__global uint *keys
+	)
+{
+	const uint id = get_global_id(0);
+	if (id >= count)
+		return;
+	
+	const Ray r = rays[live[id]];
+	const Vector extent = max(bvh->max - bvh->min, (Vector)(EPSILON, EPSILON, EPSILON));
+	const Vector cell = clamp((r.o - bvh->min) / extent, 0.f, 1.f) * 127.f;
+	const uint octant = (r.d.x < 0.f) | ((r.d.y < 0.f) << 1) | ((r.d.z < 0.f) << 2);
+	
+	keys[id] = (octant << 21) |
+		(morton_spread((uint)cell.x) << 2) |
+		(morton_spread((uint)cell.y) << 1) |
+		morton_spread((uint)cell.z);
+}
+
+__kernel void wf_radix_count(
+	__global const uint *keys,
+	unsigned int count,
+	unsigned int shift,
+	__global uint *hist
+	)
+{
+	__local uint local_hist[RADIX_BINS];
+	const uint id = get_global_id(0);
+	const uint lid = get_local_id(0);
+	
+	if (lid < RADIX_BINS)
+		local_hist[lid] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	if (id < count)
+		atomic_inc(&local_hist[(keys[id] >> shift) & (RADIX_BINS - 1)]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	if (lid < RADIX_BINS)
+		hist[lid * get_num_groups(0) + get_group_id(0)] = local_hist[lid];
+}
+
+// one work group
+__kernel void wf_radix_scan(
+	__global uint *hist,
+	unsigned int numgroups
+	)
+{
+	__local uint scan[WAVEFRONT_GROUP];
+	wf_group_scan(hist, RADIX_BINS * numgroups, 0, scan);
+}
+
+__kernel void wf_radix_scatter(
+	__global const uint *keys,
+	__global const uint *values,
+	unsigned int count,
+	unsigned int shift,
+	__global const uint *hist,
+	__global uint *keys_out,
+	__global uint *values_out
+	)
+{
+	__local uint local_digits[WAVEFRONT_GROUP];
+	const uint id = get_global_id(0);
+	const uint lid = get_local_id(0);
+	const uint key = id < count ? keys[id] : 0;
+	const uint digit = id < count ? (key >> shift) & (RADIX_BINS - 1) : RADIX_BINS;
+	
+	local_digits[lid] = digit;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	
+	if (id >= count)
+		return;
+	
+	uint rank = 0;
+	for (uint i = 0; i < lid; i++)
+		rank += (local_digits[i] == digit);
+	
+	const uint dst = hist[digit * get_num_groups(0) + get_group_id(0)] + rank;
+	keys_out[dst] = key;
+	values_out[dst] = values[id];
+}
+
+// Stream compaction of the live path list between bounces: a work group prefix
+// sum of the alive flags, a scan of the group totals and a scatter, keeping the
+// path order. The next bounce only launches over the paths left.
+__kernel void wf_compact_scan(
+	__global const PathState *paths,
+	__global const uint *live,
+	unsigned int count,
+	__global uint *offsets,
+	__global uint *group_sum
+	)
+{
+	__local uint scan[WAVEFRONT_GROUP];
+	const uint id = get_global_id(0);
+	const uint lid = get_local_id(0);
+	const uint alive = id < count && paths[live[id]].depth > 0;
+	
+	// Hillis-Steele inclusive scan
+	scan[lid] = alive;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint offset = 1; offset < WAVEFRONT_GROUP; offset <<= 1) {
+		const uint v = lid >= offset ? scan[lid - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		scan[lid] += v;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	
+	offsets[id] = scan[lid] - alive;
+	if (lid == WAVEFRONT_GROUP - 1)
+		group_sum[get_group_id(0)] = scan[lid];
+}
+
+// one work group, with PROFILING also records the rays entering the bounce
+__kernel void wf_compact_groups(
+	__global counter_t *counter,
+	__global uint *group_sum,
+	unsigned int numgroups,
+	__global uint *live_count,
+	unsigned int bounce
+	)
+{
+	__local uint scan[WAVEFRONT_GROUP];
+	const uint sum = wf_group_scan(group_sum, numgroups, 0, scan);
+	if (get_local_id(0) != 0)
+		return;
+	
+	*live_count = sum;
+#ifdef PROFILING
+	if (COUNTER_BOUNCE + bounce < 10)
+		counter->c[COUNTER_BOUNCE + bounce] += sum;
+#endif
+}
+
+__kernel void wf_compact_scatter(
+	__global const PathState *paths,
+	__global const uint *live,
+	unsigned int count,
+	__global const uint *offsets,
+	__global const uint *group_sum,
+	__global uint *next_live
+	)
+{
+	const uint id = get_global_id(0);
+	if (id >= count)
+		return;
+	
+	const uint path = live[id];
+	if (paths[path].depth > 0)
+		next_live[group_sum[get_group_id(0)] + offsets[id]] = path;
+}
+
+// direct lighting for the queued diffuse hits, before the bounce moves the ray;
+// one shadow ray per light goes to the shadow buffer, wf_occlusion traces them.
+// Only the lights [light_first, light_end) in emissive order are connected, the host
+// runs SHADOW_CHUNK of them at a time; the sampler state carries over between passes
+__kernel void wf_connect(
+	PRIM_SPACE Primitive *primitives,
+	int numprimitives,
+	__global PathState *paths,
+	__global const Ray *rays,
+	__global const Hit *hits,
+	__global const uint *queues,
+	unsigned int first,
+	unsigned int count,
+	__global ShadowRay *shadows,
+	__global uint *shadow_count,
+	unsigned int light_first,
+	unsigned int light_end
+	)
+{
+	if (get_global_id(0) >= count)
+		return;
+	
+	const uint id = queues[first + get_global_id(0)];
+	PathState path = paths[id];
+	const Ray r = rays[id];
+	const Hit hit = hits[id];
+	PRIM_SPACE Primitive *s = primitives + hit.pid;
+	
+	Vector hit_point, normal;
+	float cos_i;
+	bool leaving;
+	hit_setup(s, &r, hit.distance, &hit_point, &normal, &cos_i, &leaving);
+	
+	const Vector weight = path.illum * s->m.c;
+	const Vector tangent = light_tangent(&r, normal, cos_i);
+	
+	uint n = 0;
+	for (int i = 0; i < LIGHT_COUNT(numprimitives) && n < light_end; i++) {
+		PRIM_SPACE Primitive *l = LIGHT(primitives, i);
+		if (l->m.e == 0.f || n++ < light_first)
+			continue;
+		
+		ShadowRay shadow;
+		shadow.r = light_ray(l, &path.smp, hit_point, normal, &shadow.distance);
+		shadow.contribution = weight * light_contribution(l, &shadow.r, &r, normal, tangent, shadow.distance);
+		shadow.path = id;
+		
+		// nothing to add even if the light is visible
+		if (luminance(shadow.contribution) > 0.f)
+			shadows[atomic_inc(shadow_count)] = shadow;
+	}
+	
+	if (light_first == 0)
+		path.sample = path.sample + weight * ambient;
+	paths[id] = path;
+}
+
+// any-hit test of the batched shadow rays, visible lights add to their path;
+// launched for the worst case, the real count is only known on the device
+__kernel void wf_occlusion(
+	__global counter_t *counter,
+	PRIM_SPACE Primitive *primitives,
+	int numprimitives,
+	BVH_SPACE BVHNode *bvh,
+	__global const ShadowRay *shadows,
+	__global const uint *shadow_count,
+	__global PathState *paths
+	)
+{
+	TREELET_DECLARE(bvh);
+	const uint id = get_global_id(0);
+	if (id >= *shadow_count)
+		return;
+	
+	const ShadowRay shadow = shadows[id];
+	Ray s_ray = shadow.r;
+	float light_dist = shadow.distance;
+	PRIM_SPACE Primitive *h;
+	
+	if (!scene_intersect(counter, primitives, numprimitives, &s_ray, &h, bvh, treelet, &light_dist, true)) {
+		// a path can be lit by several lights at once
+		volatile __global float *sample = (volatile __global float *)&paths[shadow.path].sample;
+		atomic_addf(sample, shadow.contribution.x);
+		atomic_addf(sample + 1, shadow.contribution.y);
+		atomic_addf(sample + 2, shadow.contribution.z);
+	}
+}
+
+// applies the material to a queued hit and writes the next ray; the branch is
+// folded away as every shading kernel passes a constant material
+inline void wf_shade(
+	PRIM_SPACE Primitive *primitives,
+	__global PathState *paths,
+	__global Ray *rays,
+	__global const Hit *hits,
+	__global Accum *accum,
+	const uint id,
+	const Surface material
+	)
+{
+	PathState path = paths[id];
+	Ray r = rays[id];
+	const Hit hit = hits[id];
+	PRIM_SPACE Primitive *s = primitives + hit.pid;
+	
+	Vector hit_point, normal;
+	float cos_i;
+	bool leaving;
+	hit_setup(s, &r, hit.distance, &hit_point, &normal, &cos_i, &leaving);
+	
+	path.illum = path.illum * s->m.c;
+	
+	if (material == Diffuse) {
+		material_diffuse(&path, &r, hit_point, normal);
+	}
+	else if (material == Metal) {
+		material_metal(&path, &r, hit_point, normal, cos_i);
+	}
+	else if (material == Specular) {
+		material_specular(&path, &r, hit_point, normal, cos_i);
+	}
+	else if (material == Dielectric) {
+		material_dielectric(&path, &r, hit_point, normal, cos_i, leaving);
+	}
+	
+	// out of bounces
+	if (--path.depth == 0)
+		accum_add(accum, path.smp.pixel, path.sample);
+	
+	paths[id] = path;
+	rays[id] = r;
+}
+
+__kernel void wf_shade_diffuse(
+	PRIM_SPACE Primitive *primitives,
+	__global PathState *paths,
+	__global Ray *rays,
+	__global const Hit *hits,
+	__global Accum *accum,
+	__global const uint *queues,
+	unsigned int first,
+	unsigned int count
+	)
+{
+	if (get_global_id(0) < count)
+		wf_shade(primitives, paths, rays, hits, accum, queues[first + get_global_id(0)], Diffuse);
+}
+
+__kernel void wf_shade_specular(
+	PRIM_SPACE Primitive *primitives,
+	__global PathState *paths,
+	__global Ray *rays,
+	__global const Hit *hits,
+	__global Accum *accum,
+	__global const uint *queues,
+	unsigned int first,
+	unsigned int count
+	)
+{
+	if (get_global_id(0) < count)
+		wf_shade(primitives, paths, rays, hits, accum, queues[first + get_global_id(0)], Specular);
+}
+
+__kernel void wf_shade_dielectric(
+	PRIM_SPACE Primitive *primitives,
+	__global PathState *paths,
+	__global Ray *rays,
+	__global const Hit *hits,
+	__global Accum *accum,
+	__global const uint *queues,
+	unsigned int first,
+	unsigned int count
+	)
+{
+	if (get_global_id(0) < count)
+		wf_shade(primitives, paths, rays, hits, accum, queues[first + get_global_id(0)], Dielectric);
+}
+
+__kernel void wf_shade_metal(
+	PRIM_SPACE Primitive *primitives,
+	__global PathState *paths,
+	__global Ray *rays,
+	__global const Hit *hits,
+	__global Accum *accum,
+	__global const uint *queues,
+	unsigned int first,
+	unsigned int count
+	)
+{
+	if (get_global_id(0) < count)
+		wf_shade(primitives, paths, rays, hits, accum, queues[first + get_global_id(0)], Metal);
+}
+
+#endif